@@ -0,0 +1,522 @@
+/*
+ * Load generator for the simplechar devices. Each thread opens the device
+ * and issues a random mix of reads and writes until the run ends, timing
+ * every call. Latencies go into log-linear histograms (32 linear steps per
+ * power of two, so any reported value is within about 3%), which are merged
+ * at the end and printed as text, CSV or JSON.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "../include/simplechar.h"
+
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS) * SUB_COUNT + SUB_COUNT)
+
+enum { OP_READ, OP_WRITE, OP_COUNT };
+
+static const char * const op_names[OP_COUNT] = { "read", "write" };
+
+struct hist {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+struct op_stats {
+    struct hist lat; // successful calls, ns
+    uint64_t bytes;
+    uint64_t again; // EAGAIN: nothing to read, interval not elapsed, rate limited
+    uint64_t full; // ENOSPC: buffer or ring full
+    uint64_t errors; // anything else
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int fd;
+    struct op_stats ops[OP_COUNT];
+};
+
+static struct {
+    const char *device;
+    const char *label;
+    int threads;
+    size_t write_size;
+    size_t read_size;
+    int read_pct;
+    double duration;
+    int format; // 0 text, 1 csv, 2 json
+    int csv_header;
+    int nonblock;
+    int reset;
+    long long interval_ms; // jiffies: SIMPLECHAR_JIFFIES_SET_INTERVAL
+    long long udelay_us; // delay: SIMPLECHAR_DELAY_SET_UDELAY
+    int delay_mode; // delay: SIMPLECHAR_DELAY_SET_MODE
+    long long tick_us; // time: SIMPLECHAR_TIME_SET_TICK
+} cfg = {
+    .label = "",
+    .threads = 1,
+    .write_size = 64,
+    .read_size = 4096,
+    .read_pct = 50,
+    .duration = 5,
+    .csv_header = 1,
+    .interval_ms = -1,
+    .udelay_us = -1,
+    .delay_mode = -1,
+    .tick_us = -1,
+};
+
+static volatile int stop;
+static pthread_barrier_t start_barrier;
+
+static const char * const delay_mode_names[] = {
+    [SIMPLECHAR_DELAY_BUSY] = "busy",
+    [SIMPLECHAR_DELAY_USLEEP] = "usleep",
+    [SIMPLECHAR_DELAY_HRTIMER] = "hrtimer",
+    [SIMPLECHAR_DELAY_HYBRID] = "hybrid",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < SUB_COUNT)
+        return v;
+    shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return (shift + 1) * SUB_COUNT + (unsigned int)((v >> shift) - SUB_COUNT);
+}
+
+/* Largest value that lands in bucket i. */
+static uint64_t hist_value(unsigned int i)
+{
+    unsigned int shift;
+
+    if (i < SUB_COUNT)
+        return i;
+    shift = i / SUB_COUNT - 1;
+    return (((uint64_t)(SUB_COUNT + i % SUB_COUNT) + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+    int i;
+
+    if (from->count == 0)
+        return;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+    if (to->count == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->count += from->count;
+    to->sum += from->sum;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+    uint64_t want, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    want = (uint64_t)(pct / 100.0 * h->count + 0.5);
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t rnd_next(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static void count_error(struct op_stats *st, int err)
+{
+    if (err == EAGAIN)
+        st->again++;
+    else if (err == ENOSPC)
+        st->full++;
+    else
+        st->errors++;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t rnd = 0x9e3779b97f4a7c15ull * (w->id + 1);
+    char *rbuf, *wbuf;
+    uint64_t t0, t1;
+    ssize_t ret;
+    size_t i;
+    int op;
+
+    rbuf = malloc(cfg.read_size);
+    wbuf = malloc(cfg.write_size ? cfg.write_size : 1);
+    if (!rbuf || !wbuf) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < cfg.write_size; i++)
+        wbuf[i] = 'a' + (w->id + i) % 26;
+
+    pthread_barrier_wait(&start_barrier);
+    while (!stop) {
+        op = (int)(rnd_next(&rnd) % 100) < cfg.read_pct ? OP_READ : OP_WRITE;
+        // Offset 0: every read is a fresh snapshot and writes never run out of buffer.
+        t0 = now_ns();
+        if (op == OP_READ)
+            ret = pread(w->fd, rbuf, cfg.read_size, 0);
+        else
+            ret = pwrite(w->fd, wbuf, cfg.write_size, 0);
+        t1 = now_ns();
+        if (ret < 0) {
+            count_error(&w->ops[op], errno);
+            continue;
+        }
+        hist_add(&w->ops[op].lat, t1 - t0);
+        w->ops[op].bytes += ret;
+    }
+
+    free(rbuf);
+    free(wbuf);
+    return NULL;
+}
+
+/* Expand the short names to the device nodes the modules create. */
+static const char *device_path(const char *name)
+{
+    if (!strcmp(name, "time"))
+        return "/dev/simplechartime";
+    if (!strcmp(name, "delay"))
+        return "/dev/simplechardelay";
+    if (!strcmp(name, "jiffies"))
+        return "/dev/simplechartest";
+    return name;
+}
+
+static int setup_device(void)
+{
+    uint64_t val;
+    uint32_t val32;
+    int fd;
+
+    fd = open(cfg.device, O_RDWR);
+    if (fd < 0) {
+        perror(cfg.device);
+        return -1;
+    }
+    if (cfg.reset && ioctl(fd, SIMPLECHAR_IOC_RESET) < 0)
+        perror("reset");
+    if (cfg.interval_ms >= 0) {
+        val = cfg.interval_ms;
+        if (ioctl(fd, SIMPLECHAR_JIFFIES_SET_INTERVAL, &val) < 0)
+            perror("set interval");
+    }
+    if (cfg.udelay_us >= 0) {
+        val = cfg.udelay_us;
+        if (ioctl(fd, SIMPLECHAR_DELAY_SET_UDELAY, &val) < 0)
+            perror("set udelay");
+    }
+    if (cfg.delay_mode >= 0) {
+        val32 = cfg.delay_mode;
+        if (ioctl(fd, SIMPLECHAR_DELAY_SET_MODE, &val32) < 0)
+            perror("set delay mode");
+    }
+    if (cfg.tick_us >= 0) {
+        val = cfg.tick_us;
+        if (ioctl(fd, SIMPLECHAR_TIME_SET_TICK, &val) < 0)
+            perror("set tick");
+    }
+    close(fd);
+    return 0;
+}
+
+static void print_text(const struct op_stats *ops, double secs)
+{
+    const struct op_stats *st;
+    int op;
+
+    printf("%s%sdevice %s, %d threads, %zu byte writes, %d%% reads, %.2f s\n",
+           cfg.label, *cfg.label ? ": " : "", cfg.device, cfg.threads,
+           cfg.write_size, cfg.read_pct, secs);
+    for (op = 0; op < OP_COUNT; op++) {
+        st = &ops[op];
+        if (!st->lat.count && !st->again && !st->full && !st->errors)
+            continue;
+        printf("%-5s %12.0f ops/s %10.2f MB/s  again %llu full %llu errors %llu\n",
+               op_names[op], st->lat.count / secs, st->bytes / secs / 1e6,
+               (unsigned long long)st->again, (unsigned long long)st->full,
+               (unsigned long long)st->errors);
+        if (!st->lat.count)
+            continue;
+        printf("      ns: min %llu mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu p99.99 %llu max %llu\n",
+               (unsigned long long)st->lat.min,
+               (unsigned long long)(st->lat.sum / st->lat.count),
+               (unsigned long long)hist_percentile(&st->lat, 50),
+               (unsigned long long)hist_percentile(&st->lat, 90),
+               (unsigned long long)hist_percentile(&st->lat, 99),
+               (unsigned long long)hist_percentile(&st->lat, 99.9),
+               (unsigned long long)hist_percentile(&st->lat, 99.99),
+               (unsigned long long)st->lat.max);
+    }
+}
+
+static void print_csv(const struct op_stats *ops, double secs)
+{
+    const struct op_stats *st;
+    int op;
+
+    if (cfg.csv_header)
+        printf("label,device,threads,write_size,read_pct,duration_s,op,ops,bytes,again,full,errors,"
+               "ops_per_s,mb_per_s,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,p9999_ns,max_ns\n");
+    for (op = 0; op < OP_COUNT; op++) {
+        st = &ops[op];
+        printf("%s,%s,%d,%zu,%d,%.3f,%s,%llu,%llu,%llu,%llu,%llu,%.1f,%.3f,"
+               "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+               cfg.label, cfg.device, cfg.threads, cfg.write_size, cfg.read_pct, secs,
+               op_names[op], (unsigned long long)st->lat.count,
+               (unsigned long long)st->bytes, (unsigned long long)st->again,
+               (unsigned long long)st->full, (unsigned long long)st->errors,
+               st->lat.count / secs, st->bytes / secs / 1e6,
+               (unsigned long long)st->lat.min,
+               (unsigned long long)(st->lat.count ? st->lat.sum / st->lat.count : 0),
+               (unsigned long long)hist_percentile(&st->lat, 50),
+               (unsigned long long)hist_percentile(&st->lat, 90),
+               (unsigned long long)hist_percentile(&st->lat, 99),
+               (unsigned long long)hist_percentile(&st->lat, 99.9),
+               (unsigned long long)hist_percentile(&st->lat, 99.99),
+               (unsigned long long)st->lat.max);
+    }
+}
+
+static void print_json(const struct op_stats *ops, double secs)
+{
+    const struct op_stats *st;
+    int op;
+
+    printf("{\"label\": \"%s\", \"device\": \"%s\", \"threads\": %d, \"write_size\": %zu, "
+           "\"read_pct\": %d, \"duration_s\": %.3f",
+           cfg.label, cfg.device, cfg.threads, cfg.write_size, cfg.read_pct, secs);
+    for (op = 0; op < OP_COUNT; op++) {
+        st = &ops[op];
+        printf(", \"%s\": {\"ops\": %llu, \"bytes\": %llu, \"again\": %llu, \"full\": %llu, "
+               "\"errors\": %llu, \"ops_per_s\": %.1f, \"mb_per_s\": %.3f, \"latency_ns\": "
+               "{\"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+               "\"p99.9\": %llu, \"p99.99\": %llu, \"max\": %llu}}",
+               op_names[op], (unsigned long long)st->lat.count,
+               (unsigned long long)st->bytes, (unsigned long long)st->again,
+               (unsigned long long)st->full, (unsigned long long)st->errors,
+               st->lat.count / secs, st->bytes / secs / 1e6,
+               (unsigned long long)st->lat.min,
+               (unsigned long long)(st->lat.count ? st->lat.sum / st->lat.count : 0),
+               (unsigned long long)hist_percentile(&st->lat, 50),
+               (unsigned long long)hist_percentile(&st->lat, 90),
+               (unsigned long long)hist_percentile(&st->lat, 99),
+               (unsigned long long)hist_percentile(&st->lat, 99.9),
+               (unsigned long long)hist_percentile(&st->lat, 99.99),
+               (unsigned long long)st->lat.max);
+    }
+    printf("}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -d DEVICE [options]\n"
+            "  -d DEVICE    time, delay, jiffies or a device path\n"
+            "  -t THREADS   worker threads, each with its own fd (default 1)\n"
+            "  -s BYTES     write size (default 64)\n"
+            "  -b BYTES     read buffer size (default 4096)\n"
+            "  -r PCT       percentage of reads in the mix (default 50)\n"
+            "  -D SECS      run time (default 5)\n"
+            "  -o FORMAT    text, csv or json (default text)\n"
+            "  -H           no CSV header, for appending runs\n"
+            "  -l LABEL     tag for this run in the output, e.g. the backend\n"
+            "  -n           open with O_NONBLOCK\n"
+            "  -R           reset the device first\n"
+            "  -i MS        jiffies: minimum read interval\n"
+            "  -u US        delay: per-byte write delay\n"
+            "  -m MODE      delay: busy, usleep, hrtimer or hybrid\n"
+            "  -T US        time: tick period\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct op_stats total[OP_COUNT];
+    struct worker *workers;
+    struct timespec ts;
+    uint64_t start, end;
+    double secs;
+    int i, op, c;
+
+    while ((c = getopt(argc, argv, "d:t:s:b:r:D:o:Hl:nRi:u:m:T:")) != -1) {
+        switch (c) {
+        case 'd':
+            cfg.device = device_path(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 's':
+            cfg.write_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            cfg.read_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            cfg.read_pct = atoi(optarg);
+            break;
+        case 'D':
+            cfg.duration = atof(optarg);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "text"))
+                cfg.format = 0;
+            else if (!strcmp(optarg, "csv"))
+                cfg.format = 1;
+            else if (!strcmp(optarg, "json"))
+                cfg.format = 2;
+            else
+                usage(argv[0]);
+            break;
+        case 'H':
+            cfg.csv_header = 0;
+            break;
+        case 'l':
+            cfg.label = optarg;
+            break;
+        case 'n':
+            cfg.nonblock = 1;
+            break;
+        case 'R':
+            cfg.reset = 1;
+            break;
+        case 'i':
+            cfg.interval_ms = atoll(optarg);
+            break;
+        case 'u':
+            cfg.udelay_us = atoll(optarg);
+            break;
+        case 'm':
+            for (i = 0; i < (int)(sizeof(delay_mode_names) / sizeof(delay_mode_names[0])); i++)
+                if (!strcmp(optarg, delay_mode_names[i]))
+                    cfg.delay_mode = i;
+            if (cfg.delay_mode < 0)
+                usage(argv[0]);
+            break;
+        case 'T':
+            cfg.tick_us = atoll(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!cfg.device || cfg.threads < 1 || cfg.read_pct < 0 || cfg.read_pct > 100 ||
+        cfg.duration <= 0 || cfg.read_size == 0)
+        usage(argv[0]);
+
+    if (setup_device() < 0)
+        return 1;
+
+    workers = calloc(cfg.threads, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < cfg.threads; i++) {
+        workers[i].id = i;
+        workers[i].fd = open(cfg.device, O_RDWR | (cfg.nonblock ? O_NONBLOCK : 0));
+        if (workers[i].fd < 0) {
+            perror(cfg.device);
+            return 1;
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, cfg.threads + 1);
+    for (i = 0; i < cfg.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    ts.tv_sec = (time_t)cfg.duration;
+    ts.tv_nsec = (long)((cfg.duration - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    stop = 1;
+    end = now_ns();
+    // Blocking reads on the delay device only return once data or the read delay arrives.
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    secs = (end - start) / 1e9;
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < cfg.threads; i++) {
+        for (op = 0; op < OP_COUNT; op++) {
+            hist_merge(&total[op].lat, &workers[i].ops[op].lat);
+            total[op].bytes += workers[i].ops[op].bytes;
+            total[op].again += workers[i].ops[op].again;
+            total[op].full += workers[i].ops[op].full;
+            total[op].errors += workers[i].ops[op].errors;
+        }
+        close(workers[i].fd);
+    }
+
+    if (cfg.format == 1)
+        print_csv(total, secs);
+    else if (cfg.format == 2)
+        print_json(total, secs);
+    else
+        print_text(total, secs);
+
+    free(workers);
+    return 0;
+}
@@ -7,226 +7,1193 @@
 #include <linux/device.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/string.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/prandom.h>
+#include <linux/percpu.h>
+
+#include <simplechar.h>
+#include <simplechar_ring.h>
+#include <simplechar_pages.h>
+#include <simplechar_debug.h>
+#include <simplechar_text.h>
+
+#define CREATE_TRACE_POINTS
+#include "delays_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Timur");
-MODULE_DESCRIPTION("A simple char device driver with single device");
+MODULE_DESCRIPTION("A simple char device driver with one or more devices");
 MODULE_VERSION("1.0");
 
+static int num_devices = 1;
+module_param(num_devices, int, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent devices; more than one are named simplechardelayN");
+
+static bool ring_mode;
+module_param(ring_mode, bool, 0444);
+MODULE_PARM_DESC(ring_mode, "Stream data through a FIFO instead of the fixed 1 KB buffer");
+
+module_param_cb(debug, &simplechar_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log opens, reads and writes to the kernel log (slow; prefer the tracepoints)");
+
+static unsigned int ring_cap_kb = 64;
+module_param(ring_cap_kb, uint, 0444);
+MODULE_PARM_DESC(ring_cap_kb, "Max data queued in ring mode, in KB");
+
+static unsigned int sweep_samples = 100;
+module_param(sweep_samples, uint, 0644);
+MODULE_PARM_DESC(sweep_samples, "Samples per point of the debugfs delay sweep");
+
+#define HIST_BUCKETS 64
+
+/* Measured delays in ns; bucket b holds [2^b, 2^(b+1)), bucket 0 also holds 0. */
+struct simplechar_hist {
+    u64 buckets[HIST_BUCKETS];
+    u64 count;
+    u64 sum;
+    u64 min;
+    u64 max;
+};
+
 struct simplechar_dev {
-    char *data;            
+    char *data; // one page, so it can be mmap()ed
+    struct simplechar_delay_stats *stats; // mmap()able mirror of the settings and stats
+    spinlock_t stats_lock; // serializes updates of the stats page
+    struct simplechar_ring ring; // data store in ring_mode
     unsigned long size;    
     unsigned long delay_ms; // delay in read (ig long delays)
     unsigned long udelay_us; // delay in write (short delays)
     unsigned long ndelay_ns; // delay in write (shrt delays)
-    unsigned long total_delay_ns; // stat of delays
+    unsigned long total_delay_ns; // measured time spent in write delays
+    int delay_mode; // enum simplechar_delay_mode
+    bool delay_per_write; // delay once per write instead of once per byte
+    struct simplechar_hist hist[SIMPLECHAR_DELAY_HYBRID + 1]; // per delay_mode
+    spinlock_t hist_lock;
+    struct dentry *debugfs;
     wait_queue_head_t waitq; // queue for long delays
-    int data_ready; // condition for wait event
+    atomic64_t write_seq; // writes so far
+    atomic64_t read_seq; // writes taken; in exclusive mode each reader claims one
+    atomic64_t reset_seq; // write_seq at the last reset; older writes count as taken
+    int wake_mode; // enum simplechar_wake_mode
+    atomic64_t text_gen; // bumped after each change to what read() shows
+    struct simplechar_text __rcu *text; // last read() text, tagged with text_gen
     struct cdev cdev;      
 };
 
-static struct simplechar_dev simplechar_device;
-static dev_t simplechar_devno; 
+/* Latency injected before every read and data write on one open file. */
+struct simplechar_profile {
+    int kind; // enum simplechar_profile_kind
+    u64 a;
+    u64 b;
+    u64 *trace; // uploaded samples, ns
+    unsigned int trace_len;
+    unsigned int trace_pos;
+};
+
+struct simplechar_file {
+    struct simplechar_dev *dev;
+    s64 seen_seq; // last write this reader has taken
+    spinlock_t lock; // protects profile
+    struct simplechar_profile profile;
+    struct simplechar_text __rcu *text; // snapshot a partial read() left to continue
+};
+
+static struct simplechar_dev **simplechar_devices;
+static dev_t simplechar_devno;
 static struct class *simplechar_class;
-#define BUFFER_SIZE 1024 
+static struct kmem_cache *simplechar_ring_cache;
+static struct dentry *simplechar_debugfs;
+static DEFINE_MUTEX(simplechar_sweep_lock);
+#define BUFFER_SIZE 1024
+#define TEXT_SIZE (BUFFER_SIZE + 256) // room for the whole buffer and the settings
+#define MAX_DEVICES 256 
+#define HYBRID_SPIN_NS 20000 // tail left to busy-wait in hybrid mode
+#define USLEEP_MAX_US 20000 // longer usleep-mode delays go through msleep_interruptible()
+#define PROFILE_SPIN_NS 10000 // injected delays below this are cheaper to spin
+#define PROFILE_MAX_NS (10 * NSEC_PER_SEC)
+#define PROFILE_TRACE_MAX 65536
 
-static int simplechar_open(struct inode *inode, struct file *filp)
+static DEFINE_PER_CPU(struct rnd_state, simplechar_rnd);
+
+/* 2^(2^-(i+1)) in Q31 */
+static const u32 simplechar_exp2_frac[16] = {
+    3037000500u, 2553802834u, 2341847524u, 2242560872u,
+    2194507417u, 2170868212u, 2159144272u, 2153306067u,
+    2150392887u, 2148937775u, 2148210589u, 2147847087u,
+    2147665360u, 2147574502u, 2147529075u, 2147506361u,
+};
+
+static const char * const simplechar_delay_names[] = {
+    [SIMPLECHAR_DELAY_BUSY] = "busy",
+    [SIMPLECHAR_DELAY_USLEEP] = "usleep",
+    [SIMPLECHAR_DELAY_HRTIMER] = "hrtimer",
+    [SIMPLECHAR_DELAY_HYBRID] = "hybrid",
+};
+
+/* Mirror the device state into the mmap stats page. */
+static void simplechar_stats_publish(struct simplechar_dev *dev)
 {
-    filp->private_data = &simplechar_device;
-    printk(KERN_INFO "simplechar: Opened device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
-    return 0;
+    struct simplechar_delay_stats *st = dev->stats;
+
+    spin_lock(&dev->stats_lock);
+    WRITE_ONCE(st->seq, st->seq + 1);
+    smp_wmb();
+    st->wake_mode = dev->wake_mode;
+    st->write_seq = atomic64_read(&dev->write_seq);
+    st->read_seq = atomic64_read(&dev->read_seq);
+    st->size = dev->size;
+    st->delay_ms = dev->delay_ms;
+    st->udelay_us = dev->udelay_us;
+    st->ndelay_ns = dev->ndelay_ns;
+    st->total_delay_ns = dev->total_delay_ns;
+    st->update_ns = ktime_get_ns();
+    st->delay_mode = dev->delay_mode;
+    st->delay_per_write = dev->delay_per_write;
+    smp_wmb();
+    WRITE_ONCE(st->seq, st->seq + 1);
+    spin_unlock(&dev->stats_lock);
 }
 
-static int simplechar_release(struct inode *inode, struct file *filp)
+/*
+ * Busy-wait, in udelay()-safe pieces, rescheduling between milliseconds.
+ * Gives up with -EINTR once the task has been killed.
+ */
+static int simplechar_spin_ns(u64 ns)
 {
-    printk(KERN_INFO "simplechar: Released device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    while (ns >= NSEC_PER_MSEC) {
+        udelay(1000);
+        ns -= NSEC_PER_MSEC;
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    if (ns >= NSEC_PER_USEC)
+        udelay((unsigned long)ns / NSEC_PER_USEC);
+    if (ns % NSEC_PER_USEC)
+        ndelay((unsigned long)ns % NSEC_PER_USEC);
     return 0;
 }
- 
-static ssize_t simplechar_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
-{
-    struct simplechar_dev *dev = filp->private_data;
-    char tmp_buf[BUFFER_SIZE];
-    ssize_t retval = 0;
-    int len;
 
-    if (dev->delay_ms) {
-        int ret = wait_event_interruptible_timeout(
-            dev->waitq,
-            dev->data_ready,
-            msecs_to_jiffies(dev->delay_ms)
-        );
+/*
+ * Sleep for ns, up to slack ns more, or until a signal arrives (-EINTR).
+ * The expiry is absolute, so any other early wakeup just goes back to
+ * sleep for the rest.
+ */
+static int simplechar_hrtimer_sleep_range_ns(u64 ns, u64 slack)
+{
+    ktime_t expires = ktime_add_ns(ktime_get(), ns);
 
-        if (ret == 0) {
-            printk(KERN_INFO "simplechar: read timeout\n");
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!schedule_hrtimeout_range(&expires, slack, HRTIMER_MODE_ABS))
             return 0;
-        }
-        if (ret < 0) {
-            printk(KERN_INFO "simplechar: interrupted while sleeping\n");
+        if (signal_pending(current))
             return -EINTR;
-        }
-        dev->data_ready = 0;
     }
+}
+
+static int simplechar_hrtimer_sleep_ns(u64 ns)
+{
+    return simplechar_hrtimer_sleep_range_ns(ns, 0);
+}
+
+/* Delay the writer by ns using the device's delay_mode. Returns 0 or -EINTR. */
+static int simplechar_delay(struct simplechar_dev *dev, u64 ns)
+{
+    unsigned long us;
+    u64 deadline;
 
-    if (dev->size == 0)
+    switch (dev->delay_mode) {
+    case SIMPLECHAR_DELAY_USLEEP:
+        us = DIV_ROUND_UP_ULL(ns, NSEC_PER_USEC);
+        if (us > USLEEP_MAX_US)
+            return msleep_interruptible(min_t(unsigned long, DIV_ROUND_UP(us, USEC_PER_MSEC),
+                                              UINT_MAX)) ? -EINTR : 0;
+        usleep_range(us, us + us / 8 + 1);
         return 0;
+    case SIMPLECHAR_DELAY_HRTIMER:
+        return simplechar_hrtimer_sleep_ns(ns);
+    case SIMPLECHAR_DELAY_HYBRID:
+        // Wakeups land late, never early: sleep short of the deadline, then spin.
+        deadline = ktime_get_ns() + ns;
+        if (ns > HYBRID_SPIN_NS && simplechar_hrtimer_sleep_ns(ns - HYBRID_SPIN_NS))
+            return -EINTR;
+        while (ktime_get_ns() < deadline)
+            cpu_relax();
+        return 0;
+    default:
+        return simplechar_spin_ns(ns);
+    }
+}
+
+static void simplechar_hist_add(struct simplechar_hist *h, u64 ns)
+{
+    h->buckets[ns ? ilog2(ns) : 0]++;
+    if (h->count == 0 || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->count++;
+    h->sum += ns;
+}
+
+/*
+ * Estimate a percentile (in per mille) by interpolating inside the
+ * bucket that holds it, clamped to the observed min/max.
+ */
+static u64 simplechar_hist_pct(const struct simplechar_hist *h, unsigned int permille)
+{
+    u64 rank = div_u64(h->count * permille + 999, 1000);
+    u64 seen = 0;
+    u64 lo, span, ns;
+    int b;
 
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
+    if (h->count == 0)
+        return 0;
+    rank = max_t(u64, rank, 1);
 
-    if (dev->size == 0 || *f_pos >= dev->size) {
-        return 0; 
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (seen + h->buckets[b] >= rank)
+            break;
+        seen += h->buckets[b];
     }
+    if (b == HIST_BUCKETS)
+        return h->max;
 
-    len = snprintf(tmp_buf, BUFFER_SIZE,
-        "data: %.*s\n"
-        "total_delay_ns: %lu\n",
-        (int)count, dev->data + *f_pos, dev->total_delay_ns);
+    lo = b ? 1ULL << b : 0;
+    span = b ? 1ULL << b : 2;
+    ns = lo + div64_u64(span * (rank - seen), h->buckets[b]);
+    return clamp_t(u64, ns, h->min, h->max);
+}
 
-    if (copy_to_user(buf, tmp_buf, len)) {
-        printk(KERN_ERR "simplechar: Failed to copy data to user\n");
-        return -EFAULT;
+static void simplechar_hist_show(struct seq_file *m, const char *name, u64 target,
+                                 const struct simplechar_hist *h)
+{
+    seq_printf(m, "%-8s %10llu %8llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+               name, target, h->count, h->min, h->max,
+               h->count ? div64_u64(h->sum, h->count) : 0,
+               simplechar_hist_pct(h, 500), simplechar_hist_pct(h, 990),
+               simplechar_hist_pct(h, 999));
+}
+
+#define HIST_HEADER "%-8s %10s %8s %10s %10s %10s %10s %10s %10s\n", \
+    "delay", "target_ns", "samples", "min_ns", "max_ns", "mean_ns", "p50_ns", "p99_ns", "p999_ns"
+
+/* debugfs <dev>/hist: measured write delays, one row per delay_mode. */
+static int simplechar_hist_debugfs_show(struct seq_file *m, void *unused)
+{
+    struct simplechar_dev *dev = m->private;
+    struct simplechar_hist *h;
+    int i;
+
+    h = kmalloc(sizeof(*h), GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+
+    seq_printf(m, HIST_HEADER);
+    for (i = 0; i < ARRAY_SIZE(dev->hist); i++) {
+        spin_lock(&dev->hist_lock);
+        *h = dev->hist[i];
+        spin_unlock(&dev->hist_lock);
+        simplechar_hist_show(m, simplechar_delay_names[i], 0, h);
     }
 
-    *f_pos += len;
-    if (*f_pos >= dev->size) return 0;
-    retval = len;
-    printk(KERN_INFO "simplechar: Read %zd bytes from pos %lld\n", retval, *f_pos);
-    return retval;
+    kfree(h);
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(simplechar_hist_debugfs);
 
+enum simplechar_sweep_prim {
+    SWEEP_NDELAY,
+    SWEEP_UDELAY,
+    SWEEP_USLEEP,
+    SWEEP_MSLEEP,
+    SWEEP_HRTIMER,
+};
 
-static ssize_t simplechar_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* Each primitive is swept over the decade targets between min_ns and max_ns. */
+static const struct {
+    const char *name;
+    u64 min_ns;
+    u64 max_ns;
+} simplechar_sweep_prims[] = {
+    [SWEEP_NDELAY] = { "ndelay", 100, 10 * NSEC_PER_USEC },
+    [SWEEP_UDELAY] = { "udelay", NSEC_PER_USEC, NSEC_PER_MSEC },
+    [SWEEP_USLEEP] = { "usleep", 10 * NSEC_PER_USEC, 10 * NSEC_PER_MSEC },
+    [SWEEP_MSLEEP] = { "msleep", NSEC_PER_MSEC, 10 * NSEC_PER_MSEC },
+    [SWEEP_HRTIMER] = { "hrtimer", NSEC_PER_USEC, 10 * NSEC_PER_MSEC },
+};
+
+static int simplechar_sweep_one(int prim, u64 target)
 {
-    struct simplechar_dev *dev = filp->private_data;
-    char tmp_buf[BUFFER_SIZE];
-    unsigned long new_delay_ms, new_udelay_us, new_ndelay_ns;
-    ssize_t i;
+    unsigned long us = (unsigned long)div_u64(target, NSEC_PER_USEC);
 
-    if (*f_pos + count > BUFFER_SIZE) {
-        count = BUFFER_SIZE - *f_pos;
-        if (count == 0) {
-            printk(KERN_ERR "simplechar: Buffer full\n");
-            return -ENOSPC;
-        }
+    switch (prim) {
+    case SWEEP_NDELAY:
+        ndelay((unsigned long)target);
+        break;
+    case SWEEP_UDELAY:
+        udelay(us);
+        break;
+    case SWEEP_USLEEP:
+        usleep_range(us, us);
+        break;
+    case SWEEP_MSLEEP:
+        msleep((unsigned int)div_u64(target, NSEC_PER_MSEC));
+        break;
+    case SWEEP_HRTIMER:
+        return simplechar_hrtimer_sleep_ns(target);
     }
+    return 0;
+}
 
-    if (copy_from_user(tmp_buf, buf, count)) {
-        printk(KERN_ERR "simplechar: Failed to copy data from user\n");
-        return -EFAULT;
+/*
+ * debugfs sweep: benchmark the kernel delay primitives on this machine.
+ * Reading it runs the sweep, which takes a few seconds.
+ */
+static int simplechar_sweep_show(struct seq_file *m, void *unused)
+{
+    unsigned int samples = READ_ONCE(sweep_samples);
+    struct simplechar_hist *h;
+    u64 target, start;
+    unsigned int n;
+    int prim, err = 0;
+
+    h = kmalloc(sizeof(*h), GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+
+    mutex_lock(&simplechar_sweep_lock);
+    seq_printf(m, HIST_HEADER);
+    for (prim = 0; prim < ARRAY_SIZE(simplechar_sweep_prims); prim++) {
+        for (target = simplechar_sweep_prims[prim].min_ns;
+             target <= simplechar_sweep_prims[prim].max_ns; target *= 10) {
+            memset(h, 0, sizeof(*h));
+            for (n = 0; n < samples; n++) {
+                start = ktime_get_ns();
+                err = simplechar_sweep_one(prim, target);
+                if (err)
+                    goto out;
+                simplechar_hist_add(h, ktime_get_ns() - start);
+                cond_resched();
+            }
+            simplechar_hist_show(m, simplechar_sweep_prims[prim].name, target, h);
+        }
     }
+out:
+    mutex_unlock(&simplechar_sweep_lock);
 
-    tmp_buf[count - 1] = '\0';
+    kfree(h);
+    return err;
+}
+
+static int simplechar_sweep_open(struct inode *inode, struct file *file)
+{
+    // Size the buffer up front: seq_file reruns show() if the output overflows.
+    return single_open_size(file, simplechar_sweep_show, NULL, 2 * PAGE_SIZE);
+}
+
+static const struct file_operations simplechar_sweep_fops = {
+    .owner = THIS_MODULE,
+    .open = simplechar_sweep_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* The last write a broadcast reader has taken; a reset drops the rest for everyone. */
+static s64 simplechar_seen(struct simplechar_file *f)
+{
+    return max_t(s64, f->seen_seq, atomic64_read(&f->dev->reset_seq));
+}
+
+/* Does the reader have a write to take? */
+static bool simplechar_pending(struct simplechar_file *f)
+{
+    struct simplechar_dev *dev = f->dev;
+    s64 seq = atomic64_read(&dev->write_seq);
+
+    if (READ_ONCE(dev->wake_mode) == SIMPLECHAR_WAKE_EXCLUSIVE)
+        return seq > atomic64_read(&dev->read_seq);
+    return seq > simplechar_seen(f);
+}
 
-    if(strncmp(tmp_buf, "reset", 5) == 0)
-    {
-        dev->delay_ms = 0;
-        dev->udelay_us = 0;
-        dev->ndelay_ns = 0;
-        dev->total_delay_ns = 0;
-        dev->data_ready = 0;
-        dev->size = 0;
-        memset(dev->data, 0, BUFFER_SIZE);
-        return count;
+/*
+ * Take the next write for this reader. In exclusive mode readers race to
+ * claim one write each through read_seq; in broadcast mode a reader takes
+ * everything written since it last read, and read_seq only tracks the
+ * newest write any reader has taken.
+ */
+static bool simplechar_take(struct simplechar_file *f)
+{
+    struct simplechar_dev *dev = f->dev;
+    s64 seq = atomic64_read(&dev->write_seq);
+    s64 old = atomic64_read(&dev->read_seq);
+
+    if (READ_ONCE(dev->wake_mode) == SIMPLECHAR_WAKE_EXCLUSIVE) {
+        do {
+            if (old >= seq)
+                return false;
+        } while (!atomic64_try_cmpxchg(&dev->read_seq, &old, old + 1));
+        f->seen_seq = old + 1;
+        return true;
     }
 
-    if(sscanf(tmp_buf, "delay_ms=%lu", &new_delay_ms) == 1)
-    {
-        dev->delay_ms = new_delay_ms;
-        return count;
+    if (seq <= simplechar_seen(f))
+        return false;
+    f->seen_seq = seq;
+    while (old < seq && !atomic64_try_cmpxchg(&dev->read_seq, &old, seq))
+        ;
+    return true;
+}
+
+/*
+ * Sleep until simplechar_take() succeeds. Exclusive readers queue with
+ * WQ_FLAG_EXCLUSIVE so a write wakes only one of them; broadcast readers
+ * are all woken. Returns the jiffies left, 0 on timeout or -ERESTARTSYS.
+ */
+static long simplechar_wait(struct simplechar_file *f, long timeout)
+{
+    struct simplechar_dev *dev = f->dev;
+    bool exclusive = READ_ONCE(dev->wake_mode) == SIMPLECHAR_WAKE_EXCLUSIVE;
+    bool taken = false;
+    DEFINE_WAIT(wait);
+
+    for (;;) {
+        if (exclusive)
+            prepare_to_wait_exclusive(&dev->waitq, &wait, TASK_INTERRUPTIBLE);
+        else
+            prepare_to_wait(&dev->waitq, &wait, TASK_INTERRUPTIBLE);
+
+        if (simplechar_take(f)) {
+            taken = true;
+            break;
+        }
+        if (signal_pending(current)) {
+            timeout = -ERESTARTSYS;
+            break;
+        }
+        if (!timeout)
+            break;
+        timeout = schedule_timeout(timeout);
     }
+    finish_wait(&dev->waitq, &wait);
 
-    if(sscanf(tmp_buf, "udelay_us=%lu", &new_udelay_us) == 1)
-    {
-        if(new_udelay_us > 1000) // secure from __bad_udelay
-        {
-            return -EINVAL;
+    // We may have eaten the wakeup meant for a write we did not take.
+    if (exclusive && !taken && simplechar_pending(f))
+        wake_up_interruptible(&dev->waitq);
+
+    return taken ? max(timeout, 1L) : timeout;
+}
+
+static u32 simplechar_rand(void)
+{
+    struct rnd_state *state = get_cpu_ptr(&simplechar_rnd);
+    u32 r = prandom_u32_state(state);
+
+    put_cpu_ptr(&simplechar_rnd);
+    return r;
+}
+
+/* -log2(r / 2^32) in Q16, for r != 0: the bits come from squaring the mantissa. */
+static u32 simplechar_neg_log2_q16(u32 r)
+{
+    int n = ilog2(r);
+    u64 m = (u64)r << (31 - n); // mantissa in [1, 2), Q31
+    u32 frac = 0;
+    int i;
+
+    for (i = 15; i >= 0; i--) {
+        m = (m * m) >> 31;
+        if (m >= 1ULL << 32) {
+            m >>= 1;
+            frac |= 1U << i;
         }
-        dev->udelay_us = new_udelay_us;
-        return count;
     }
+    return ((u32)(32 - n) << 16) - frac;
+}
+
+/* x * 2^(y / 2^16), capped at PROFILE_MAX_NS. */
+static u64 simplechar_exp2_scale(u64 x, u32 y)
+{
+    unsigned int k = y >> 16;
+    u64 f = 1ULL << 31; // 2^frac(y), Q31
+    u64 m;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        if (y & (1U << (15 - i)))
+            f = (f * simplechar_exp2_frac[i]) >> 31;
+    m = mul_u64_u32_shr(x, (u32)f, 31);
+
+    if (k >= 64 || m > PROFILE_MAX_NS >> k)
+        return PROFILE_MAX_NS;
+    return m << k;
+}
+
+static u64 simplechar_profile_sample(struct simplechar_file *f)
+{
+    struct simplechar_profile *p = &f->profile;
+    u32 r = simplechar_rand() | 1; // uniform in (0, 1] once scaled by 2^-32
+    u64 ns = 0;
+
+    spin_lock(&f->lock);
+    switch (p->kind) {
+    case SIMPLECHAR_PROFILE_FIXED:
+        ns = p->a;
+        break;
+    case SIMPLECHAR_PROFILE_UNIFORM:
+        ns = p->a + mul_u64_u32_shr(p->b - p->a + 1, r, 32);
+        break;
+    case SIMPLECHAR_PROFILE_EXP:
+        // -ln(u) = -log2(u) * ln(2); ln(2) is 45426 in Q16
+        ns = mul_u64_u32_shr(p->a, (u32)(((u64)simplechar_neg_log2_q16(r) * 45426) >> 16), 16);
+        break;
+    case SIMPLECHAR_PROFILE_PARETO:
+        // a * u^(-1/shape)
+        ns = simplechar_exp2_scale(p->a, (u32)div_u64((u64)simplechar_neg_log2_q16(r) * 100, p->b));
+        break;
+    case SIMPLECHAR_PROFILE_TRACE:
+        ns = p->trace[p->trace_pos];
+        if (++p->trace_pos == p->trace_len)
+            p->trace_pos = 0;
+        break;
+    }
+    spin_unlock(&f->lock);
+
+    return min_t(u64, ns, PROFILE_MAX_NS);
+}
+
+/*
+ * Apply the file's profile. Short samples spin, since a sleep and wakeup
+ * costs more than they do; the rest sleep on an hrtimer with a little
+ * slack so neighbouring expiries can share an interrupt. Returns -EINTR
+ * if a signal ends the sleep.
+ */
+static int simplechar_profile_inject(struct simplechar_file *f)
+{
+    u64 ns;
+
+    if (READ_ONCE(f->profile.kind) == SIMPLECHAR_PROFILE_NONE)
+        return 0;
+
+    ns = simplechar_profile_sample(f);
+    if (ns < PROFILE_SPIN_NS) {
+        if (ns)
+            ndelay((unsigned long)ns);
+        return 0;
+    }
+
+    return simplechar_hrtimer_sleep_range_ns(ns, ns >> 6);
+}
 
-    if(sscanf(tmp_buf, "ndelays_ns=%lu", &new_ndelay_ns) == 1)
-    {
-        if(new_ndelay_ns > 1000000) // secure from long ndelay
-        {
+static int simplechar_profile_set(struct simplechar_file *f,
+                                  const struct simplechar_delay_profile *set)
+{
+    struct simplechar_profile *p = &f->profile;
+    int ret = 0;
+
+    switch (set->kind) {
+    case SIMPLECHAR_PROFILE_UNIFORM:
+        if (set->b < set->a)
+            return -EINVAL;
+        break;
+    case SIMPLECHAR_PROFILE_PARETO:
+        if (set->a == 0 || set->b == 0)
             return -EINVAL;
+        break;
+    case SIMPLECHAR_PROFILE_NONE:
+    case SIMPLECHAR_PROFILE_FIXED:
+    case SIMPLECHAR_PROFILE_EXP:
+    case SIMPLECHAR_PROFILE_TRACE:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    spin_lock(&f->lock);
+    if (set->kind == SIMPLECHAR_PROFILE_TRACE && p->trace_len == 0) {
+        ret = -EINVAL;
+    } else {
+        p->a = set->a;
+        p->b = set->b;
+        p->trace_pos = 0;
+        WRITE_ONCE(p->kind, set->kind);
+    }
+    spin_unlock(&f->lock);
+    return ret;
+}
+
+/* Replace or extend the file's trace; SIMPLECHAR_PROFILE_TRACE replays it. */
+static int simplechar_trace_set(struct simplechar_file *f,
+                                const struct simplechar_delay_trace *set)
+{
+    struct simplechar_profile *p = &f->profile;
+    bool append = set->flags & SIMPLECHAR_TRACE_APPEND;
+    unsigned int keep, len;
+    u64 *trace, *old;
+
+    if (set->flags & ~SIMPLECHAR_TRACE_APPEND)
+        return -EINVAL;
+
+    spin_lock(&f->lock);
+    keep = append ? p->trace_len : 0;
+    spin_unlock(&f->lock);
+
+    if (set->count > PROFILE_TRACE_MAX - keep)
+        return -E2BIG;
+    len = keep + set->count;
+    trace = kvmalloc_array(max(len, 1U), sizeof(*trace), GFP_KERNEL);
+    if (!trace)
+        return -ENOMEM;
+    if (copy_from_user(trace + keep, u64_to_user_ptr(set->samples),
+                       (size_t)set->count * sizeof(*trace))) {
+        kvfree(trace);
+        return -EFAULT;
+    }
+
+    spin_lock(&f->lock);
+    if (keep != (append ? p->trace_len : 0)) {
+        // Raced with another update of the same file.
+        spin_unlock(&f->lock);
+        kvfree(trace);
+        return -EBUSY;
+    }
+    if (keep)
+        memcpy(trace, p->trace, keep * sizeof(*trace));
+    old = p->trace;
+    p->trace = trace;
+    p->trace_len = len;
+    p->trace_pos = 0;
+    if (p->trace_len == 0 && p->kind == SIMPLECHAR_PROFILE_TRACE)
+        WRITE_ONCE(p->kind, SIMPLECHAR_PROFILE_NONE);
+    spin_unlock(&f->lock);
+
+    kvfree(old);
+    return 0;
+}
+
+static int simplechar_open(struct inode *inode, struct file *filp)
+{
+    struct simplechar_dev *dev = container_of(inode->i_cdev, struct simplechar_dev, cdev);
+    struct simplechar_file *f;
+
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f)
+        return -ENOMEM;
+    f->dev = dev;
+    spin_lock_init(&f->lock);
+    // Writes no reader has taken yet are still there for a new reader.
+    f->seen_seq = atomic64_read(&dev->read_seq);
+    filp->private_data = f;
+    filp->f_mode |= FMODE_NOWAIT;
+    trace_simplechar_open(MINOR(inode->i_rdev));
+    simplechar_dbg("Opened device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    return 0;
+}
+
+static int simplechar_release(struct inode *inode, struct file *filp)
+{
+    struct simplechar_file *f = filp->private_data;
+
+    kvfree(f->profile.trace);
+    simplechar_text_set(&f->text, NULL);
+    kfree(f);
+    trace_simplechar_release(MINOR(inode->i_rdev));
+    simplechar_dbg("Released device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    return 0;
+}
+ 
+/* Note a change to what read() shows, once the change has been made. */
+static void simplechar_text_changed(struct simplechar_dev *dev)
+{
+    smp_mb__before_atomic();
+    atomic64_inc(&dev->text_gen);
+}
+
+/*
+ * The read() text tagged gen. It is only formatted again once the data or
+ * a setting it shows has changed, so repeated reads are a copy. gen is
+ * read before the state is formatted: a text can be newer than its tag,
+ * never older.
+ */
+static struct simplechar_text *simplechar_text_snapshot(struct simplechar_dev *dev, u64 gen)
+{
+    struct simplechar_text *t;
+
+    t = simplechar_text_lookup(&dev->text, gen, 0);
+    if (t)
+        return t;
+
+    t = simplechar_text_alloc(TEXT_SIZE, gen, 0);
+    if (!t)
+        return NULL;
+    t->len = scnprintf(t->buf, TEXT_SIZE,
+        "data: %.*s\n"
+        "total_delay_ns: %lu\n"
+        "delay_mode: %s\n"
+        "delay_per: %s\n"
+        "wake_mode: %s\n",
+        (int)min_t(unsigned long, dev->size, BUFFER_SIZE), dev->data, dev->total_delay_ns,
+        simplechar_delay_names[dev->delay_mode],
+        dev->delay_per_write ? "write" : "byte",
+        dev->wake_mode == SIMPLECHAR_WAKE_EXCLUSIVE ? "exclusive" : "broadcast");
+    simplechar_text_set(&dev->text, t);
+    return t;
+}
+
+static ssize_t simplechar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    bool nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos = *f_pos;
+    struct simplechar_text *text = NULL;
+    ssize_t retval = 0;
+    u64 gen;
+    int err;
+
+    // Past the start, keep going through the snapshot this file began with.
+    if (!ring_mode && pos > 0)
+        text = simplechar_text_get(&f->text);
+
+    /*
+     * Once a snapshot has been read to the end, or was read in one go and
+     * never kept, the next one starts at offset 0 again, as there is no
+     * llseek to get back there. Without a read delay that read reports EOF
+     * first so cat stops; with one it waits for and takes the next write
+     * like any other read.
+     */
+    if (!ring_mode && pos > 0 && (!text || pos >= text->len)) {
+        if (text) {
+            simplechar_text_put(text);
+            text = NULL;
+            simplechar_text_set(&f->text, NULL);
         }
-        dev->ndelay_ns = new_ndelay_ns;
-        return count;
+        *f_pos = pos = 0;
+        if (!dev->delay_ms)
+            return 0;
     }
 
-    for(i = 0; i < count; i++)
-    {
-        if(dev->udelay_us)
-        {
-            udelay(dev->udelay_us);
+    // A read that continues a snapshot is part of the same request: no second sample.
+    if (!text) {
+        // io_uring retries a nowait read that would sleep from a worker.
+        if ((iocb->ki_flags & IOCB_NOWAIT) &&
+            READ_ONCE(f->profile.kind) != SIMPLECHAR_PROFILE_NONE)
+            return -EAGAIN;
+        err = simplechar_profile_inject(f);
+        if (err)
+            return err;
+    }
+
+    if (!text && dev->delay_ms) {
+        if (nowait) {
+            if (!simplechar_take(f))
+                return -EAGAIN;
+        } else {
+            long ret = simplechar_wait(f, msecs_to_jiffies(dev->delay_ms));
+
+            if (ret == 0) {
+                simplechar_dbg("read timeout\n");
+                return 0;
+            }
+            if (ret < 0) {
+                simplechar_dbg("interrupted while sleeping\n");
+                return -EINTR;
+            }
         }
-        if(dev->ndelay_ns)
-        {
-            ndelay(dev->ndelay_ns);
+        simplechar_stats_publish(dev);
+    }
+
+    if (ring_mode) {
+        if (nowait && !simplechar_ring_used(&dev->ring))
+            return -EAGAIN;
+        retval = simplechar_ring_read(&dev->ring, to, count);
+        trace_simplechar_read(MINOR(dev->cdev.dev), pos, retval);
+        return retval;
+    }
+
+    if (!text) {
+        if (dev->size == 0)
+            return 0;
+        gen = atomic64_read_acquire(&dev->text_gen);
+        retval = simplechar_text_read_cached(&dev->text, &f->text, gen, 0, to, f_pos);
+        if (retval)
+            goto out;
+        text = simplechar_text_snapshot(dev, gen);
+        if (!text)
+            return -ENOMEM;
+    }
+
+    retval = simplechar_text_read_file(&f->text, text, to, f_pos);
+    simplechar_text_put(text);
+out:
+    if (retval == -EFAULT)
+        simplechar_dbg("Failed to copy data to user\n");
+    trace_simplechar_read(MINOR(dev->cdev.dev), pos, retval);
+    simplechar_dbg("Read %zd bytes from pos %lld\n", retval, pos);
+    return retval;
+}
+
+
+static ssize_t simplechar_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    size_t count = iov_iter_count(from);
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos = *f_pos;
+    u64 delay_ns, start, took_ns;
+    int err;
+
+    if (count == 0)
+        return 0;
+
+    if (ring_mode) {
+        // Only delay for what the ring can take, so per-byte delays match the bytes queued.
+        count = min(count, dev->ring.cap - simplechar_ring_used(&dev->ring));
+        if (count == 0)
+            return -ENOSPC;
+    } else {
+        // Checked before the clamp: past the end, BUFFER_SIZE - *f_pos would wrap.
+        if (*f_pos >= BUFFER_SIZE) {
+            simplechar_dbg("Buffer full\n");
+            return -ENOSPC;
         }
-        dev->total_delay_ns +=(dev->udelay_us * 1000) + dev->ndelay_ns;
+        count = min_t(size_t, count, BUFFER_SIZE - *f_pos);
+    }
+
+    // The whole write's delay is taken in one go, so sleeping modes need one wakeup.
+    delay_ns = (u64)dev->udelay_us * NSEC_PER_USEC + dev->ndelay_ns;
+    if (!dev->delay_per_write)
+        delay_ns *= count;
+    if ((iocb->ki_flags & IOCB_NOWAIT) &&
+        (delay_ns || READ_ONCE(f->profile.kind) != SIMPLECHAR_PROFILE_NONE))
+        return -EAGAIN;
+    if (delay_ns) {
+        int mode_used = dev->delay_mode;
+
+        start = ktime_get_ns();
+        err = simplechar_delay(dev, delay_ns);
+        took_ns = ktime_get_ns() - start;
+        dev->total_delay_ns += took_ns;
+        simplechar_text_changed(dev);
+        trace_simplechar_delay(MINOR(dev->cdev.dev), mode_used, delay_ns, took_ns);
+        // A signal cut the delay short: nothing was written and the sample is not kept.
+        if (err)
+            return err;
+
+        spin_lock(&dev->hist_lock);
+        simplechar_hist_add(&dev->hist[mode_used], took_ns);
+        spin_unlock(&dev->hist_lock);
     }
 
-    memcpy(dev->data + *f_pos, tmp_buf, count);
+    err = simplechar_profile_inject(f);
+    if (err)
+        return err;
 
-    *f_pos += count;
-    if (dev->size < *f_pos) 
-        dev->size = *f_pos;
+    if (ring_mode) {
+        ssize_t queued = simplechar_ring_write(&dev->ring, from, count);
 
-    dev->data_ready = 1;
-    wake_up_interruptible(&dev->waitq);
+        if (queued < 0)
+            return queued;
+        count = queued;
+    } else {
+        count = copy_from_iter(dev->data + *f_pos, count, from);
+        if (count == 0) {
+            simplechar_dbg("Failed to copy data from user\n");
+            return -EFAULT;
+        }
+
+        *f_pos += count;
+        if (dev->size < *f_pos) 
+            dev->size = *f_pos;
+        simplechar_text_changed(dev);
+    }
 
-    printk(KERN_INFO "simplechar: Wrote %zd bytes to pos %lld\n", count, *f_pos);
+    atomic64_inc(&dev->write_seq);
+    simplechar_stats_publish(dev);
+    // Wakes every broadcast reader and poller but only one exclusive reader.
+    if (wq_has_sleeper(&dev->waitq))
+        wake_up_interruptible(&dev->waitq);
+
+    trace_simplechar_write(MINOR(dev->cdev.dev), pos, count);
+    simplechar_dbg("Wrote %zd bytes to pos %lld\n", count, *f_pos);
     return count;
 }
 
+static void simplechar_reset(struct simplechar_dev *dev)
+{
+    dev->delay_ms = 0;
+    dev->udelay_us = 0;
+    dev->ndelay_ns = 0;
+    dev->total_delay_ns = 0;
+    dev->delay_mode = SIMPLECHAR_DELAY_BUSY;
+    dev->delay_per_write = false;
+    WRITE_ONCE(dev->wake_mode, SIMPLECHAR_WAKE_BROADCAST);
+    // Drop untaken writes; the sequence numbers themselves never go back.
+    atomic64_set(&dev->reset_seq, atomic64_read(&dev->write_seq));
+    atomic64_set(&dev->read_seq, atomic64_read(&dev->reset_seq));
+    dev->size = 0;
+    memset(dev->data, 0, BUFFER_SIZE);
+    spin_lock(&dev->hist_lock);
+    memset(dev->hist, 0, sizeof(dev->hist));
+    spin_unlock(&dev->hist_lock);
+    simplechar_ring_reset(&dev->ring);
+    simplechar_text_changed(dev);
+    simplechar_stats_publish(dev);
+}
+
+static long simplechar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    void __user *argp = (void __user *)arg;
+    struct simplechar_delay_profile profile;
+    struct simplechar_delay_trace trace;
+    struct simplechar_delay_stats st;
+    u64 val;
+    u32 val32;
+
+    switch (cmd) {
+    case SIMPLECHAR_IOC_RESET:
+        simplechar_reset(dev);
+        return 0;
+
+    case SIMPLECHAR_DELAY_GET_STATS:
+        spin_lock(&dev->stats_lock);
+        st = *dev->stats;
+        spin_unlock(&dev->stats_lock);
+        return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+
+    case SIMPLECHAR_DELAY_SET_READ_DELAY:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > UINT_MAX)
+            return -EINVAL;
+        dev->delay_ms = val;
+        break;
+
+    case SIMPLECHAR_DELAY_SET_UDELAY:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > 1000) // secure from __bad_udelay
+            return -EINVAL;
+        dev->udelay_us = val;
+        break;
+
+    case SIMPLECHAR_DELAY_SET_NDELAY:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > 1000000) // secure from long ndelay
+            return -EINVAL;
+        dev->ndelay_ns = val;
+        break;
+
+    case SIMPLECHAR_DELAY_SET_MODE:
+        if (get_user(val32, (u32 __user *)argp))
+            return -EFAULT;
+        if (val32 >= ARRAY_SIZE(simplechar_delay_names))
+            return -EINVAL;
+        dev->delay_mode = val32;
+        simplechar_text_changed(dev);
+        break;
+
+    case SIMPLECHAR_DELAY_SET_PER_WRITE:
+        if (get_user(val32, (u32 __user *)argp))
+            return -EFAULT;
+        dev->delay_per_write = val32 != 0;
+        simplechar_text_changed(dev);
+        break;
+
+    case SIMPLECHAR_DELAY_SET_WAKE_MODE:
+        if (get_user(val32, (u32 __user *)argp))
+            return -EFAULT;
+        if (val32 != SIMPLECHAR_WAKE_BROADCAST && val32 != SIMPLECHAR_WAKE_EXCLUSIVE)
+            return -EINVAL;
+        WRITE_ONCE(dev->wake_mode, val32);
+        simplechar_text_changed(dev);
+        break;
+
+    case SIMPLECHAR_DELAY_SET_PROFILE:
+        if (copy_from_user(&profile, argp, sizeof(profile)))
+            return -EFAULT;
+        return simplechar_profile_set(f, &profile);
+
+    case SIMPLECHAR_DELAY_SET_TRACE:
+        if (copy_from_user(&trace, argp, sizeof(trace)))
+            return -EFAULT;
+        return simplechar_trace_set(f, &trace);
+
+    default:
+        return -ENOTTY;
+    }
+
+    simplechar_stats_publish(dev);
+    return 0;
+}
+
+/*
+ * Readable when a read would not block: with delay_ms set that means a
+ * write is there for this reader to take, in ring mode that data is queued.
+ */
+static __poll_t simplechar_poll(struct file *filp, poll_table *wait)
+{
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->waitq, wait);
+
+    if (dev->delay_ms ? simplechar_pending(f) :
+        !ring_mode || simplechar_ring_used(&dev->ring))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+/*
+ * Map the data page and/or the stats page read-only, see simplechar.h.
+ */
+static int simplechar_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct simplechar_file *f = filp->private_data;
+
+    return simplechar_mmap_pages(vma, f->dev->data, f->dev->stats);
+}
+
 static struct file_operations simplechar_fops = {
     .owner = THIS_MODULE,
     .open = simplechar_open,
     .release = simplechar_release,
-    .read = simplechar_read,
-    .write = simplechar_write,
+    .read_iter = simplechar_read_iter,
+    .write_iter = simplechar_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = simplechar_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = simplechar_poll,
+    .mmap = simplechar_mmap,
 };
 
-static int __init simplechar_init(void)
+static struct simplechar_dev *simplechar_create_dev(int index)
 {
+    int node = simplechar_dev_node(index);
+    dev_t devno = MKDEV(MAJOR(simplechar_devno), index);
+    struct simplechar_dev *dev;
+    struct device *device;
     int err;
 
-    printk(KERN_INFO "simplechar: Initializing module\n");
-
-    err = alloc_chrdev_region(&simplechar_devno, 0, 1, "simplechardelay");
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
 
-    if (err < 0) {
-        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
-        return err;
-    }
-
-    simplechar_device.data = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!simplechar_device.data) {
+    BUILD_BUG_ON(BUFFER_SIZE > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct simplechar_delay_stats) > PAGE_SIZE);
+    dev->data = simplechar_alloc_page(node);
+    dev->stats = simplechar_alloc_page(node);
+    if (!dev->data || !dev->stats) {
         printk(KERN_ERR "simplechar: Failed to allocate buffer\n");
         err = -ENOMEM;
         goto fail_alloc;
     }
-    simplechar_device.size = 0;
-    simplechar_device.delay_ms = 0;
-    simplechar_device.udelay_us = 0;
-    simplechar_device.ndelay_ns = 0;
-    simplechar_device.total_delay_ns = 0;
-    simplechar_device.data_ready = 0;
-    init_waitqueue_head(&simplechar_device.waitq);
-    memset(simplechar_device.data, 0, BUFFER_SIZE);
-
-    cdev_init(&simplechar_device.cdev, &simplechar_fops);
-    simplechar_device.cdev.owner = THIS_MODULE;
-    err = cdev_add(&simplechar_device.cdev, simplechar_devno, 1);
+    init_waitqueue_head(&dev->waitq);
+    spin_lock_init(&dev->stats_lock);
+    spin_lock_init(&dev->hist_lock);
+    atomic64_set(&dev->write_seq, 0);
+    atomic64_set(&dev->read_seq, 0);
+    atomic64_set(&dev->reset_seq, 0);
+    atomic64_set(&dev->text_gen, 0);
+    simplechar_stats_publish(dev);
+    simplechar_ring_init(&dev->ring, simplechar_ring_cache, (size_t)ring_cap_kb * 1024);
+
+    cdev_init(&dev->cdev, &simplechar_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
     if (err) {
         printk(KERN_ERR "simplechar: Failed to add cdev\n");
-        goto fail_cdev;
+        goto fail_alloc;
+    }
+
+    if (num_devices == 1)
+        device = device_create(simplechar_class, NULL, devno, NULL, "simplechardelay");
+    else
+        device = device_create(simplechar_class, NULL, devno, NULL, "simplechardelay%d", index);
+
+    if (!IS_ERR(device)) {
+        dev->debugfs = debugfs_create_dir(dev_name(device), simplechar_debugfs);
+        debugfs_create_file("hist", 0444, dev->debugfs, dev, &simplechar_hist_debugfs_fops);
+    }
+
+    return dev;
+
+fail_alloc:
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+    return ERR_PTR(err);
+}
+
+static void simplechar_destroy_dev(struct simplechar_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    device_destroy(simplechar_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+    simplechar_ring_destroy(&dev->ring);
+    simplechar_text_set(&dev->text, NULL);
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+}
+
+static int __init simplechar_init(void)
+{
+    struct simplechar_dev *dev;
+    int err;
+    int i;
+
+    printk(KERN_INFO "simplechar: Initializing module\n");
+
+    if (num_devices < 1 || num_devices > MAX_DEVICES) {
+        printk(KERN_ERR "simplechar: num_devices must be 1..%d\n", MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    prandom_seed_full_state(&simplechar_rnd);
+
+    simplechar_ring_cache = simplechar_ring_cache_create("simplechardelay_ring");
+    if (!simplechar_ring_cache)
+        return -ENOMEM;
+
+    simplechar_devices = kcalloc(num_devices, sizeof(*simplechar_devices), GFP_KERNEL);
+    if (!simplechar_devices) {
+        err = -ENOMEM;
+        goto fail_devices;
+    }
+
+    err = alloc_chrdev_region(&simplechar_devno, 0, num_devices, "simplechardelay");
+    if (err < 0) {
+        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
+        goto fail_region;
     }
 
     simplechar_class = class_create("simplechardelay");
@@ -235,32 +1202,48 @@ static int __init simplechar_init(void)
         printk(KERN_ERR "simplechar: Failed to create class\n");
         goto fail_class;
     }
-    device_create(simplechar_class, NULL, simplechar_devno, NULL, "simplechardelay");
+
+    simplechar_debugfs = debugfs_create_dir("simplechardelay", NULL);
+    debugfs_create_file("sweep", 0444, simplechar_debugfs, NULL, &simplechar_sweep_fops);
+
+    for (i = 0; i < num_devices; i++) {
+        dev = simplechar_create_dev(i);
+        if (IS_ERR(dev)) {
+            err = PTR_ERR(dev);
+            goto fail_dev;
+        }
+        simplechar_devices[i] = dev;
+    }
 
     return 0;
 
+fail_dev:
+    while (i--)
+        simplechar_destroy_dev(simplechar_devices[i]);
+    debugfs_remove_recursive(simplechar_debugfs);
+    class_destroy(simplechar_class);
 fail_class:
-    cdev_del(&simplechar_device.cdev);
-fail_cdev:
-    kfree(simplechar_device.data);
-fail_alloc:
-    unregister_chrdev_region(simplechar_devno, 1);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+fail_region:
+    kfree(simplechar_devices);
+fail_devices:
+    kmem_cache_destroy(simplechar_ring_cache);
     return err;
 }
 
 static void __exit simplechar_exit(void)
 {
-    device_destroy(simplechar_class, simplechar_devno);
-    class_destroy(simplechar_class);
-
-    cdev_del(&simplechar_device.cdev);
-
-    kfree(simplechar_device.data);
-
-    unregister_chrdev_region(simplechar_devno, 1);
+    int i;
 
+    for (i = 0; i < num_devices; i++)
+        simplechar_destroy_dev(simplechar_devices[i]);
+    debugfs_remove_recursive(simplechar_debugfs);
+    class_destroy(simplechar_class);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+    kfree(simplechar_devices);
+    kmem_cache_destroy(simplechar_ring_cache);
     printk(KERN_INFO "simplechar: Module unloaded\n");
 }
 
 module_init(simplechar_init);
-module_exit(simplechar_exit);
\ No newline at end of file
+module_exit(simplechar_exit);
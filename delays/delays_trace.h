@@ -0,0 +1,37 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplechar_delays
+
+#if !defined(_DELAYS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DELAYS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include <simplechar_trace.h>
+
+TRACE_EVENT(simplechar_delay,
+    TP_PROTO(unsigned int minor, int mode, u64 want_ns, u64 took_ns),
+    TP_ARGS(minor, mode, want_ns, took_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, mode)
+        __field(u64, want_ns)
+        __field(u64, took_ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->mode = mode;
+        __entry->want_ns = want_ns;
+        __entry->took_ns = took_ns;
+    ),
+    TP_printk("minor=%u mode=%d want_ns=%llu took_ns=%llu",
+              __entry->minor, __entry->mode, __entry->want_ns, __entry->took_ns)
+);
+
+#endif /* _DELAYS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE delays_trace
+#include <trace/define_trace.h>
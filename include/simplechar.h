@@ -0,0 +1,265 @@
+#ifndef _SIMPLECHAR_H
+#define _SIMPLECHAR_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Shared between the simplechar modules and userspace.
+ *
+ * Every simplechar device can be mmap()ed read-only. Page 0 is the data
+ * buffer and page 1 is a binary stats page for that device. Both can be
+ * mapped together with a two-page mapping at offset 0.
+ */
+#define SIMPLECHAR_MMAP_DATA_PGOFF 0
+#define SIMPLECHAR_MMAP_STATS_PGOFF 1
+#define SIMPLECHAR_MMAP_PAGES 2
+
+/*
+ * The stats pages start with a sequence count that is odd while the
+ * kernel is updating them. To read a consistent snapshot: load seq,
+ * retry while it is odd, copy the fields, issue a read barrier, and
+ * retry if seq has changed. Timestamps are CLOCK_MONOTONIC nanoseconds.
+ */
+
+/* /dev/simplechartime */
+struct simplechar_time_stats {
+    __u32 seq;
+    __u32 log_done;
+    __u64 tick_count; // ticks counted up to the last update, see tick_next_ns
+    __u64 tick_period_ns;
+    __u64 tick_next_ns; // ticks due after this time are not in tick_count yet
+    __u64 char_count;
+    __u64 event_gen;
+    __u64 jitter_last_ns;
+    __u64 jitter_max_ns;
+    __u64 update_ns;
+};
+
+/*
+ * /dev/simplechardelay: how a write's delay is carried out. A signal ends
+ * the delay early (only a fatal one in busy mode), and the write fails
+ * with EINTR without writing anything.
+ */
+enum simplechar_delay_mode {
+    SIMPLECHAR_DELAY_BUSY, // udelay()/ndelay() busy-wait
+    SIMPLECHAR_DELAY_USLEEP, // usleep_range(), msleep_interruptible() past 20 ms
+    SIMPLECHAR_DELAY_HRTIMER, // hrtimer sleep
+    SIMPLECHAR_DELAY_HYBRID, // hrtimer sleep for the bulk, busy-wait for the tail
+};
+
+/*
+ * /dev/simplechardelay: per-file latency distributions. One sample is
+ * added to each write and to each read that starts a new snapshot; reads
+ * that continue it are not delayed again. A signal ends the delay with
+ * EINTR.
+ */
+enum simplechar_profile_kind {
+    SIMPLECHAR_PROFILE_NONE,
+    SIMPLECHAR_PROFILE_FIXED, // a ns
+    SIMPLECHAR_PROFILE_UNIFORM, // a..b ns
+    SIMPLECHAR_PROFILE_EXP, // exponential, mean a ns
+    SIMPLECHAR_PROFILE_PARETO, // Pareto, minimum a ns, shape b / 100
+    SIMPLECHAR_PROFILE_TRACE, // replay the uploaded trace in a loop
+};
+
+/* /dev/simplechardelay: who is woken by a write */
+enum simplechar_wake_mode {
+    SIMPLECHAR_WAKE_BROADCAST, // every reader sees every write
+    SIMPLECHAR_WAKE_EXCLUSIVE, // each write goes to one reader
+};
+
+/* /dev/simplechardelay */
+struct simplechar_delay_stats {
+    __u32 seq;
+    __u32 wake_mode; // enum simplechar_wake_mode
+    __u64 write_seq; // writes so far
+    __u64 read_seq; // writes taken by a reader
+    __u64 size;
+    __u64 delay_ms;
+    __u64 udelay_us;
+    __u64 ndelay_ns;
+    __u64 total_delay_ns;
+    __u64 update_ns;
+    __u32 delay_mode; // enum simplechar_delay_mode
+    __u32 delay_per_write; // 1: one delay per write, 0: one per byte
+};
+
+/* /dev/simplechartest: why a read's interval_ns may be off */
+#define SIMPLECHAR_JIFFIES_MIGRATED 1 // read on another CPU than the previous one
+#define SIMPLECHAR_JIFFIES_UNSTABLE 2 // the cycle counter is not a stable clock
+
+/* /dev/simplechartest: clock used to timestamp reads */
+enum simplechar_clock {
+    SIMPLECHAR_CLOCK_DEFAULT, // ktime_get_ts64() and ktime_get_real_ts64()
+    SIMPLECHAR_CLOCK_JIFFIES, // get_jiffies_64()
+    SIMPLECHAR_CLOCK_COARSE, // ktime_get_coarse_ns(), last tick
+    SIMPLECHAR_CLOCK_MONO_FAST, // ktime_get_mono_fast_ns(), NMI-safe
+    SIMPLECHAR_CLOCK_RAW, // ktime_get_raw_ns(), not NTP-adjusted
+    SIMPLECHAR_CLOCK_BOOT, // ktime_get_boottime_ns(), counts suspend
+    SIMPLECHAR_CLOCK_COUNT
+};
+
+/* /dev/simplechartest */
+struct simplechar_jiffies_stats {
+    __u32 seq;
+    __u32 interval_set;
+    __u64 size;
+    __u64 last_jiffies;
+    __u64 last_cycles;
+    __u64 min_interval_ms;
+    __u64 update_ns;
+    __u32 last_cpu; // CPU of the last read, ~0 before the first
+    __u32 last_flags; // SIMPLECHAR_JIFFIES_* for the last read
+    __u64 last_interval_ns; // cycles between the last two reads, in ns
+    __u32 cycles_mult; // ns = (cycles * cycles_mult) >> cycles_shift
+    __u32 cycles_shift;
+    __u32 clock; // enum simplechar_clock
+    __u32 pad;
+};
+
+/*
+ * Control interface. All devices are configured, reset and sampled
+ * through ioctl(); write() only ever carries data. Setters take a
+ * pointer to the new value.
+ */
+#define SIMPLECHAR_IOC_MAGIC 0xb7
+
+/*
+ * Every device, with per-device effect:
+ *   simplechardelay: clear the data, ring, counters and histograms and
+ *     restore the default settings; untaken writes are dropped.
+ *   simplechartime: stop the job and bottom half and clear the data, ring
+ *     and counters; the tick period and slack are kept.
+ *   simplechartest: restart the timing base so the next read is not held
+ *     back by the interval, and empty the ring; the data buffer, size,
+ *     interval and clock are kept.
+ */
+#define SIMPLECHAR_IOC_RESET _IO(SIMPLECHAR_IOC_MAGIC, 0x00)
+
+/* /dev/simplechartime */
+#define SIMPLECHAR_TIME_GET_STATS _IOR(SIMPLECHAR_IOC_MAGIC, 0x10, struct simplechar_time_stats)
+#define SIMPLECHAR_TIME_SET_WORK_DELAY _IOW(SIMPLECHAR_IOC_MAGIC, 0x11, __u64) // ms
+#define SIMPLECHAR_TIME_SET_TICK _IOW(SIMPLECHAR_IOC_MAGIC, 0x12, __u64) // us
+#define SIMPLECHAR_TIME_SET_TICK_SLACK _IOW(SIMPLECHAR_IOC_MAGIC, 0x13, __u64) // us
+/*
+ * This file's poll waits for the first event after generation N. Events
+ * are otherwise consumed by each read() that starts a new text snapshot;
+ * a snapshot ends when a read returns 0.
+ */
+#define SIMPLECHAR_TIME_SET_GEN _IOW(SIMPLECHAR_IOC_MAGIC, 0x14, __u64)
+
+/* /dev/simplechardelay */
+struct simplechar_delay_profile {
+    __u32 kind; // enum simplechar_profile_kind
+    __u32 pad;
+    __u64 a;
+    __u64 b;
+};
+
+#define SIMPLECHAR_TRACE_APPEND 1
+
+struct simplechar_delay_trace {
+    __u64 samples; // user pointer to count __u64 samples, ns
+    __u32 count;
+    __u32 flags; // SIMPLECHAR_TRACE_*
+};
+
+#define SIMPLECHAR_DELAY_GET_STATS _IOR(SIMPLECHAR_IOC_MAGIC, 0x20, struct simplechar_delay_stats)
+#define SIMPLECHAR_DELAY_SET_READ_DELAY _IOW(SIMPLECHAR_IOC_MAGIC, 0x21, __u64) // ms, 0 = don't wait
+#define SIMPLECHAR_DELAY_SET_UDELAY _IOW(SIMPLECHAR_IOC_MAGIC, 0x22, __u64) // us, max 1000
+#define SIMPLECHAR_DELAY_SET_NDELAY _IOW(SIMPLECHAR_IOC_MAGIC, 0x23, __u64) // ns, max 1000000
+#define SIMPLECHAR_DELAY_SET_MODE _IOW(SIMPLECHAR_IOC_MAGIC, 0x24, __u32) // enum simplechar_delay_mode
+#define SIMPLECHAR_DELAY_SET_PER_WRITE _IOW(SIMPLECHAR_IOC_MAGIC, 0x25, __u32) // 1: per write, 0: per byte
+#define SIMPLECHAR_DELAY_SET_WAKE_MODE _IOW(SIMPLECHAR_IOC_MAGIC, 0x26, __u32) // enum simplechar_wake_mode
+/* Per file: */
+#define SIMPLECHAR_DELAY_SET_PROFILE _IOW(SIMPLECHAR_IOC_MAGIC, 0x27, struct simplechar_delay_profile)
+#define SIMPLECHAR_DELAY_SET_TRACE _IOW(SIMPLECHAR_IOC_MAGIC, 0x28, struct simplechar_delay_trace)
+
+/* /dev/simplechartest */
+#define SIMPLECHAR_JIFFIES_GET_STATS _IOR(SIMPLECHAR_IOC_MAGIC, 0x30, struct simplechar_jiffies_stats)
+#define SIMPLECHAR_JIFFIES_SET_INTERVAL _IOW(SIMPLECHAR_IOC_MAGIC, 0x31, __u64) // min ms between reads
+#define SIMPLECHAR_JIFFIES_SET_CLOCK _IOW(SIMPLECHAR_IOC_MAGIC, 0x32, __u32) // enum simplechar_clock
+
+/* Per-file token bucket: rate reads per second, up to burst back to back. */
+#define SIMPLECHAR_RATE_BLOCK 1 // wait for a token instead of failing with EAGAIN
+
+struct simplechar_rate {
+    __u64 rate; // reads per second, 0 turns the limit off
+    __u32 burst; // 0 is taken as 1
+    __u32 flags; // SIMPLECHAR_RATE_*
+};
+
+#define SIMPLECHAR_JIFFIES_SET_RATE _IOW(SIMPLECHAR_IOC_MAGIC, 0x34, struct simplechar_rate)
+
+/*
+ * Timing events, drained as a binary stream of these records in
+ * mono_ns order once SIMPLECHAR_JIFFIES_TRACE_STREAM is set on a file.
+ */
+#define SIMPLECHAR_EVENT_READ 1
+#define SIMPLECHAR_EVENT_WRITE 2
+
+struct simplechar_event {
+    __u64 mono_ns; // CLOCK_MONOTONIC
+    __u64 cycles; // get_cycles() on cpu
+    __u64 jiffies;
+    __u32 bytes;
+    __u16 cpu;
+    __u8 type; // SIMPLECHAR_EVENT_*
+    __u8 dev; // device minor
+};
+
+#define SIMPLECHAR_JIFFIES_TRACE_STREAM _IOW(SIMPLECHAR_IOC_MAGIC, 0x35, __u32) // 1: read() drains events
+#define SIMPLECHAR_JIFFIES_TRACE_DROPPED _IOR(SIMPLECHAR_IOC_MAGIC, 0x36, __u64) // events lost to full rings
+
+/* Cost of one clock read; SIMPLECHAR_CLOCK_DEFAULT is measured as ktime_get_ns(). */
+struct simplechar_clock_cost {
+    __u64 cost_ps_avg; // mean over all CPUs, ps per call
+    __u64 cost_ps_max; // the slowest CPU's mean
+    __u64 resolution_ns; // smallest step seen on any CPU, 0 if it never moved
+};
+
+struct simplechar_clock_bench {
+    __u32 loops; // in: calls per clock per CPU, 0 for the default
+    __u32 cpus; // out: CPUs measured
+    struct simplechar_clock_cost clock[SIMPLECHAR_CLOCK_COUNT];
+};
+
+/* Time every clock in a tight loop on each online CPU. Needs CAP_SYS_ADMIN. */
+#define SIMPLECHAR_JIFFIES_CLOCK_BENCH _IOWR(SIMPLECHAR_IOC_MAGIC, 0x33, struct simplechar_clock_bench)
+
+/*
+ * Clock offsets of one CPU against the reference CPU, from IPI round trips.
+ * Offsets are remote minus reference at the midpoint of the fastest round
+ * trip, so each is good to +/- rtt_ns / 2. The skew between any two CPUs
+ * is the difference of their offsets.
+ */
+struct simplechar_skew_cpu {
+    __u32 cpu;
+    __u32 backwards; // reads that fell outside the reference's bracketing reads
+    __s64 cycles_offset; // get_cycles() offset, in cycles
+    __s64 mono_offset_ns; // ktime_get_ns() offset
+    __u64 rtt_ns; // fastest round trip
+    __s64 cycles_drift_ppb; // change of cycles_offset over interval_ms, 0 if not measured
+    __s64 mono_drift_ppb;
+};
+
+struct simplechar_skew {
+    __u32 rounds; // in: IPIs per CPU per pass, 0 for the default
+    __u32 interval_ms; // in: gap between the two passes for drift, 0 for one pass
+    __u32 ncpus; // in: entries at cpus; out: online CPUs measured
+    __u32 ref_cpu; // out
+    __u64 cpus; // in: user pointer to struct simplechar_skew_cpu[ncpus]
+    __s64 max_skew_cycles; // out: largest pairwise cycles offset
+    __s64 max_skew_ns; // out: largest pairwise mono offset
+    __u64 backwards; // out: sum over all CPUs
+};
+
+/*
+ * Sample the cycle counter and monotonic clock on every online CPU against
+ * the first one. Drift is only reported for CPUs online in both passes.
+ * Needs CAP_SYS_ADMIN.
+ */
+#define SIMPLECHAR_JIFFIES_SKEW_CHECK _IOWR(SIMPLECHAR_IOC_MAGIC, 0x37, struct simplechar_skew)
+
+#endif /* _SIMPLECHAR_H */
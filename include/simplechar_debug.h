@@ -0,0 +1,50 @@
+#ifndef _SIMPLECHAR_DEBUG_H
+#define _SIMPLECHAR_DEBUG_H
+
+/*
+ * Debug logging for the simplechar modules. simplechar_dbg() sits behind a
+ * static key, so while the module's debug parameter is off each call is a
+ * patched-out jump and its arguments are never evaluated. Per-operation
+ * data goes to the modules' tracepoints instead.
+ */
+
+#include <linux/jump_label.h>
+#include <linux/moduleparam.h>
+#include <linux/printk.h>
+#include <linux/kstrtox.h>
+#include <linux/sysfs.h>
+
+static DEFINE_STATIC_KEY_FALSE(simplechar_debug_key);
+
+#define simplechar_dbg(fmt, ...)                                        \
+    do {                                                                \
+        if (static_branch_unlikely(&simplechar_debug_key))              \
+            printk(KERN_INFO "simplechar: " fmt, ##__VA_ARGS__);        \
+    } while (0)
+
+static inline int simplechar_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int err;
+
+    err = kstrtobool(val, &on);
+    if (err)
+        return err;
+    if (on)
+        static_branch_enable(&simplechar_debug_key);
+    else
+        static_branch_disable(&simplechar_debug_key);
+    return 0;
+}
+
+static inline int simplechar_debug_get(char *buf, const struct kernel_param *kp)
+{
+    return sysfs_emit(buf, "%c\n", static_key_enabled(&simplechar_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops simplechar_debug_ops = {
+    .set = simplechar_debug_set,
+    .get = simplechar_debug_get,
+};
+
+#endif /* _SIMPLECHAR_DEBUG_H */
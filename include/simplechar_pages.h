@@ -0,0 +1,66 @@
+#ifndef _SIMPLECHAR_PAGES_H
+#define _SIMPLECHAR_PAGES_H
+
+/*
+ * Per-device pages shared by the simplechar modules: each device has a
+ * data page and a stats page, allocated on the device's NUMA node and
+ * mapped read-only at the offsets in simplechar.h.
+ */
+
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+#include <linux/nodemask.h>
+
+#include <simplechar.h>
+
+/* Spread devices round-robin over the online NUMA nodes. */
+static inline int simplechar_dev_node(int index)
+{
+    int node = first_online_node;
+
+    while (index--) {
+        node = next_online_node(node);
+        if (node >= MAX_NUMNODES)
+            node = first_online_node;
+    }
+    return node;
+}
+
+static inline void *simplechar_alloc_page(int node)
+{
+    struct page *page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+
+    return page ? page_address(page) : NULL;
+}
+
+/* Map the data page and/or the stats page read-only into vma. */
+static inline int simplechar_mmap_pages(struct vm_area_struct *vma, void *data, void *stats)
+{
+    unsigned long pages = vma_pages(vma);
+    unsigned long i;
+    void *page;
+    int err;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    if (vma->vm_pgoff >= SIMPLECHAR_MMAP_PAGES ||
+        pages > SIMPLECHAR_MMAP_PAGES - vma->vm_pgoff)
+        return -EINVAL;
+
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+    for (i = 0; i < pages; i++) {
+        page = vma->vm_pgoff + i == SIMPLECHAR_MMAP_DATA_PGOFF ? data : stats;
+        err = remap_pfn_range(vma, vma->vm_start + i * PAGE_SIZE,
+                              virt_to_phys(page) >> PAGE_SHIFT,
+                              PAGE_SIZE, vma->vm_page_prot);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+#endif /* _SIMPLECHAR_PAGES_H */
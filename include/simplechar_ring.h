@@ -0,0 +1,177 @@
+#ifndef _SIMPLECHAR_RING_H
+#define _SIMPLECHAR_RING_H
+
+/*
+ * Streaming FIFO shared by the simplechar modules. Data lives in a list
+ * of page-sized chunks taken from a module-owned kmem_cache. Drained
+ * chunks go back to a per-ring pool instead of being freed, so once the
+ * ring has grown to its working size, writes make no allocator calls.
+ */
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/minmax.h>
+
+struct simplechar_ring_chunk {
+    struct list_head node;
+    unsigned int head; // next byte to read
+    unsigned int tail; // next byte to write
+    char data[];
+};
+
+#define SIMPLECHAR_RING_CHUNK_SIZE PAGE_SIZE
+#define SIMPLECHAR_RING_CHUNK_DATA \
+    (SIMPLECHAR_RING_CHUNK_SIZE - sizeof(struct simplechar_ring_chunk))
+
+struct simplechar_ring {
+    struct mutex lock;
+    struct list_head chunks; // queued data, oldest first
+    struct list_head pool; // drained chunks kept for reuse
+    struct kmem_cache *cache;
+    size_t used; // bytes queued
+    size_t cap; // max bytes queued
+};
+
+static inline struct kmem_cache *simplechar_ring_cache_create(const char *name)
+{
+    return kmem_cache_create(name, SIMPLECHAR_RING_CHUNK_SIZE,
+                             SIMPLECHAR_RING_CHUNK_SIZE, 0, NULL);
+}
+
+static inline void simplechar_ring_init(struct simplechar_ring *ring,
+                                        struct kmem_cache *cache, size_t cap)
+{
+    mutex_init(&ring->lock);
+    INIT_LIST_HEAD(&ring->chunks);
+    INIT_LIST_HEAD(&ring->pool);
+    ring->cache = cache;
+    ring->used = 0;
+    ring->cap = cap;
+}
+
+static inline void simplechar_ring_destroy(struct simplechar_ring *ring)
+{
+    struct simplechar_ring_chunk *c, *tmp;
+
+    list_splice_init(&ring->chunks, &ring->pool);
+    list_for_each_entry_safe(c, tmp, &ring->pool, node) {
+        list_del(&c->node);
+        kmem_cache_free(ring->cache, c);
+    }
+    ring->used = 0;
+}
+
+/* Drop all queued data; the chunks stay in the pool. */
+static inline void simplechar_ring_reset(struct simplechar_ring *ring)
+{
+    mutex_lock(&ring->lock);
+    list_splice_init(&ring->chunks, &ring->pool);
+    ring->used = 0;
+    mutex_unlock(&ring->lock);
+}
+
+static inline size_t simplechar_ring_used(struct simplechar_ring *ring)
+{
+    return READ_ONCE(ring->used);
+}
+
+static inline struct simplechar_ring_chunk *
+simplechar_ring_get_chunk(struct simplechar_ring *ring)
+{
+    struct simplechar_ring_chunk *c;
+
+    c = list_first_entry_or_null(&ring->pool, struct simplechar_ring_chunk, node);
+    if (c) {
+        list_del(&c->node);
+    } else {
+        c = kmem_cache_alloc(ring->cache, GFP_KERNEL);
+        if (!c)
+            return NULL;
+    }
+    c->head = 0;
+    c->tail = 0;
+    list_add_tail(&c->node, &ring->chunks);
+    return c;
+}
+
+/*
+ * Append up to count bytes from the iterator. Returns the number of bytes
+ * queued, -ENOSPC if the ring is at its cap, or -EFAULT/-ENOMEM if
+ * nothing could be queued.
+ */
+static inline ssize_t simplechar_ring_write(struct simplechar_ring *ring,
+                                            struct iov_iter *from, size_t count)
+{
+    struct simplechar_ring_chunk *c;
+    size_t done = 0;
+    size_t n, copied;
+    ssize_t err = 0;
+
+    mutex_lock(&ring->lock);
+
+    count = min(count, ring->cap - ring->used);
+    if (count == 0) {
+        mutex_unlock(&ring->lock);
+        return -ENOSPC;
+    }
+
+    while (done < count) {
+        c = list_empty(&ring->chunks) ? NULL :
+            list_last_entry(&ring->chunks, struct simplechar_ring_chunk, node);
+        if (!c || c->tail == SIMPLECHAR_RING_CHUNK_DATA) {
+            c = simplechar_ring_get_chunk(ring);
+            if (!c) {
+                err = -ENOMEM;
+                break;
+            }
+        }
+        n = min_t(size_t, count - done, SIMPLECHAR_RING_CHUNK_DATA - c->tail);
+        copied = copy_from_iter(c->data + c->tail, n, from);
+        c->tail += copied;
+        done += copied;
+        if (copied < n) {
+            err = -EFAULT;
+            break;
+        }
+    }
+    WRITE_ONCE(ring->used, ring->used + done);
+
+    mutex_unlock(&ring->lock);
+    return done ? done : err;
+}
+
+/* Consume up to count bytes into the iterator. Returns 0 when the ring is empty. */
+static inline ssize_t simplechar_ring_read(struct simplechar_ring *ring,
+                                           struct iov_iter *to, size_t count)
+{
+    struct simplechar_ring_chunk *c;
+    size_t done = 0;
+    size_t n, copied;
+    ssize_t err = 0;
+
+    mutex_lock(&ring->lock);
+
+    while (done < count) {
+        c = list_first_entry_or_null(&ring->chunks, struct simplechar_ring_chunk, node);
+        if (!c)
+            break;
+        n = min_t(size_t, count - done, c->tail - c->head);
+        copied = copy_to_iter(c->data + c->head, n, to);
+        c->head += copied;
+        done += copied;
+        if (c->head == c->tail)
+            list_move(&c->node, &ring->pool);
+        if (copied < n) {
+            err = -EFAULT;
+            break;
+        }
+    }
+    WRITE_ONCE(ring->used, ring->used - done);
+
+    mutex_unlock(&ring->lock);
+    return done ? done : err;
+}
+
+#endif /* _SIMPLECHAR_RING_H */
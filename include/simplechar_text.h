@@ -0,0 +1,165 @@
+#ifndef _SIMPLECHAR_TEXT_H
+#define _SIMPLECHAR_TEXT_H
+
+/*
+ * Formatted read() text shared by the simplechar modules. A device keeps
+ * its last text in a slot, tagged with the state generation it was built
+ * from, and rebuilds it only when the generation moves on. A read that
+ * takes the whole text copies it under RCU without a reference, so
+ * concurrent readers of an unchanged device write nothing shared. Only a
+ * read that stops short keeps a reference in the file's own slot, so the
+ * reads at later offsets continue the same snapshot. Texts are refcounted
+ * and freed after an RCU grace period, which lets readers take a
+ * reference from a slot without a lock.
+ */
+
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+#include <linux/minmax.h>
+#include <linux/overflow.h>
+
+struct simplechar_text {
+    refcount_t ref;
+    u64 gen; // state generation the text was built from
+    u64 tick; // state that moves without a generation bump, e.g. due ticks
+    size_t len;
+    struct rcu_head rcu;
+    char buf[];
+};
+
+static inline struct simplechar_text *simplechar_text_alloc(size_t size, u64 gen, u64 tick)
+{
+    struct simplechar_text *t;
+
+    t = kmalloc(struct_size(t, buf, size), GFP_KERNEL);
+    if (!t)
+        return NULL;
+    refcount_set(&t->ref, 1);
+    t->gen = gen;
+    t->tick = tick;
+    t->len = 0;
+    return t;
+}
+
+static inline void simplechar_text_put(struct simplechar_text *t)
+{
+    if (t && refcount_dec_and_test(&t->ref))
+        kfree_rcu(t, rcu);
+}
+
+/* Take a reference to the text in slot, or return NULL if there is none. */
+static inline struct simplechar_text *simplechar_text_get(struct simplechar_text __rcu **slot)
+{
+    struct simplechar_text *t;
+
+    rcu_read_lock();
+    t = rcu_dereference(*slot);
+    if (t && !refcount_inc_not_zero(&t->ref))
+        t = NULL;
+    rcu_read_unlock();
+    return t;
+}
+
+/* Like simplechar_text_get(), but only if the text was built from (gen, tick). */
+static inline struct simplechar_text *
+simplechar_text_lookup(struct simplechar_text __rcu **slot, u64 gen, u64 tick)
+{
+    struct simplechar_text *t = simplechar_text_get(slot);
+
+    if (t && (t->gen != gen || t->tick != tick)) {
+        simplechar_text_put(t);
+        t = NULL;
+    }
+    return t;
+}
+
+/* Store t in slot with a reference of its own, dropping the old text. NULL empties the slot. */
+static inline void simplechar_text_set(struct simplechar_text __rcu **slot,
+                                       struct simplechar_text *t)
+{
+    if (t)
+        refcount_inc(&t->ref);
+    simplechar_text_put(unrcu_pointer(xchg(slot, RCU_INITIALIZER(t))));
+}
+
+/* Copy the text from *pos on into the iterator. Returns 0 past the end. */
+static inline ssize_t simplechar_text_read(struct simplechar_text *t,
+                                           struct iov_iter *to, loff_t *pos)
+{
+    size_t n;
+
+    if (*pos < 0)
+        return -EINVAL;
+    if (*pos >= t->len)
+        return 0;
+    n = min_t(size_t, t->len - *pos, iov_iter_count(to));
+    if (copy_to_iter(t->buf + *pos, n, to) != n)
+        return -EFAULT;
+    *pos += n;
+    return n;
+}
+
+/*
+ * Read t from *pos on for an open file that keeps its snapshot in file.
+ * A read that stops short of the end leaves t in file for the reads that
+ * continue it; one that reaches the end empties file again.
+ */
+static inline ssize_t simplechar_text_read_file(struct simplechar_text __rcu **file,
+                                                struct simplechar_text *t,
+                                                struct iov_iter *to, loff_t *pos)
+{
+    ssize_t ret = simplechar_text_read(t, to, pos);
+
+    if (ret < 0)
+        return ret;
+    if (*pos < t->len) {
+        if (rcu_access_pointer(*file) != t)
+            simplechar_text_set(file, t);
+    } else if (rcu_access_pointer(*file)) {
+        simplechar_text_set(file, NULL);
+    }
+    return ret;
+}
+
+/*
+ * Start a new snapshot at *pos == 0 from the text in slot, if it was built
+ * from (gen, tick) and fits in the iterator. The copy runs under
+ * rcu_read_lock() with page faults disabled, so the text is not pinned.
+ * Returns the bytes copied, or 0 if the caller has to build or pin a text
+ * and read it with simplechar_text_read_file(): no matching text, a short
+ * buffer, or a fault (the iterator is then left as it was).
+ */
+static inline ssize_t simplechar_text_read_cached(struct simplechar_text __rcu **slot,
+                                                  struct simplechar_text __rcu **file,
+                                                  u64 gen, u64 tick,
+                                                  struct iov_iter *to, loff_t *pos)
+{
+    struct simplechar_text *t;
+    size_t n = 0;
+
+    rcu_read_lock();
+    t = rcu_dereference(*slot);
+    if (t && t->gen == gen && t->tick == tick && t->len && t->len <= iov_iter_count(to)) {
+        pagefault_disable();
+        n = copy_to_iter(t->buf, t->len, to);
+        pagefault_enable();
+        if (n != t->len) {
+            iov_iter_revert(to, n);
+            n = 0;
+        }
+    }
+    rcu_read_unlock();
+
+    if (n) {
+        *pos += n;
+        // Read in one go: nothing left to continue from an older snapshot either.
+        if (rcu_access_pointer(*file))
+            simplechar_text_set(file, NULL);
+    }
+    return n;
+}
+
+#endif /* _SIMPLECHAR_TEXT_H */
@@ -0,0 +1,62 @@
+#if !defined(_SIMPLECHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIMPLECHAR_TRACE_H
+
+/*
+ * Trace events every simplechar module has: open/release and read/write.
+ * No TRACE_SYSTEM here; each module's trace header sets its own and
+ * includes this inside its TRACE_HEADER_MULTI_READ guard, so the events
+ * are defined once per module under that module's system.
+ */
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(simplechar_file_event,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(simplechar_file_event, simplechar_open,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DEFINE_EVENT(simplechar_file_event, simplechar_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DECLARE_EVENT_CLASS(simplechar_rw_event,
+    TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%lld ret=%zd",
+              __entry->minor, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(simplechar_rw_event, simplechar_read,
+    TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret)
+);
+
+DEFINE_EVENT(simplechar_rw_event, simplechar_write,
+    TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret)
+);
+
+#endif /* _SIMPLECHAR_TRACE_H */
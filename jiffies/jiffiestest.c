@@ -9,157 +9,1009 @@
 #include <linux/time.h>
 #include <asm/msr.h>
 #include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/clocksource.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/atomic.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#ifdef CONFIG_X86
+#include <asm/tsc.h>
+#endif
+
+#include <simplechar.h>
+#include <simplechar_ring.h>
+#include <simplechar_pages.h>
+#include <simplechar_debug.h>
+
+#define CREATE_TRACE_POINTS
+#include "jiffiestest_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Timur");
-MODULE_DESCRIPTION("A simple char device driver with single device");
+MODULE_DESCRIPTION("A simple char device driver with one or more devices");
 MODULE_VERSION("1.0");
 
+static int num_devices = 1;
+module_param(num_devices, int, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent devices; more than one are named simplechartestN");
+
+static bool ring_mode;
+module_param(ring_mode, bool, 0444);
+MODULE_PARM_DESC(ring_mode, "Stream data through a FIFO instead of the fixed 1 KB buffer");
+
+module_param_cb(debug, &simplechar_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log opens, reads and writes to the kernel log (slow; prefer the tracepoints)");
+
+static unsigned int ring_cap_kb = 64;
+module_param(ring_cap_kb, uint, 0444);
+MODULE_PARM_DESC(ring_cap_kb, "Max data queued in ring mode, in KB");
+
+static unsigned int trace_events = 4096;
+module_param(trace_events, uint, 0444);
+MODULE_PARM_DESC(trace_events, "Event trace slots per CPU, rounded up to a power of two; 0 disables tracing");
+
 struct simplechar_dev {
-    char *data;
+    char *data; // one page, so it can be mmap()ed
+    struct simplechar_jiffies_stats *stats; // mmap()able mirror of the timing state
+    spinlock_t stats_lock; // serializes updates of the stats page
+    struct simplechar_ring ring; // data store in ring_mode
     unsigned long size;
     unsigned long last_jiffies;
     cycles_t last_cycles;
+    int last_cpu; // -1 until the first read
+    u32 last_flags; // SIMPLECHAR_JIFFIES_* of the last read
+    u64 last_interval_ns;
+    int clock; // enum simplechar_clock
     unsigned long min_interval_ms;
     bool interval_set; // Додано для відстеження встановлення інтервалу
     struct cdev cdev;
 };
 
-static struct simplechar_dev simplechar_device;
+/*
+ * Per-file token bucket, kept as a GCRA: tat is the theoretical arrival
+ * time of the next read in ns. A read is allowed while tat is at most
+ * tolerance_ns ahead of now, and pushes tat on by emission_ns.
+ */
+struct simplechar_file {
+    struct simplechar_dev *dev;
+    atomic64_t tat;
+    u64 emission_ns; // 1 s / rate, 0 if the file is not limited
+    u64 tolerance_ns; // (burst - 1) * emission_ns
+    bool block; // sleep for a token instead of -EAGAIN
+    bool trace_stream; // read() drains the event trace
+};
+
+/*
+ * One single-producer ring per CPU: only that CPU appends, with
+ * preemption off, and drains are serialized by simplechar_trace_lock,
+ * so head and tail each have one writer and need no lock.
+ */
+struct simplechar_trace_cpu {
+    unsigned long head; // next slot to fill, written by the owning CPU
+    unsigned long tail; // next slot to drain, written by the drainer
+    u64 dropped;
+    struct simplechar_event *ev;
+};
+
+static struct simplechar_trace_cpu __percpu *simplechar_trace;
+static DEFINE_MUTEX(simplechar_trace_lock);
+
+static struct simplechar_dev **simplechar_devices;
 static dev_t simplechar_devno;
 static struct class *simplechar_class;
+static struct kmem_cache *simplechar_ring_cache;
 #define BUFFER_SIZE 1024
+#define MAX_DEVICES 256
+#define CALIBRATE_MS 50
+#define BENCH_LOOPS 100000
+#define BENCH_MAX_LOOPS 1000000 // keeps each preempt-off loop well under a second
+#define SKEW_ROUNDS 100
+#define SKEW_MAX_ROUNDS 10000
+#define SKEW_MAX_INTERVAL_MS 60000
+
+static const char * const simplechar_clock_names[] = {
+    [SIMPLECHAR_CLOCK_DEFAULT] = "default",
+    [SIMPLECHAR_CLOCK_JIFFIES] = "jiffies",
+    [SIMPLECHAR_CLOCK_COARSE] = "coarse",
+    [SIMPLECHAR_CLOCK_MONO_FAST] = "mono_fast",
+    [SIMPLECHAR_CLOCK_RAW] = "raw",
+    [SIMPLECHAR_CLOCK_BOOT] = "boot",
+};
+
+/* get_cycles() to ns, from simplechar_calibrate(); mult is 0 if unusable. */
+static u32 simplechar_cycles_mult;
+static u32 simplechar_cycles_shift;
+
+/* Mirror the device state into the mmap stats page. */
+static void simplechar_stats_publish(struct simplechar_dev *dev)
+{
+    struct simplechar_jiffies_stats *st = dev->stats;
+
+    spin_lock(&dev->stats_lock);
+    WRITE_ONCE(st->seq, st->seq + 1);
+    smp_wmb();
+    st->interval_set = dev->interval_set;
+    st->size = dev->size;
+    st->last_jiffies = dev->last_jiffies;
+    st->last_cycles = dev->last_cycles;
+    st->min_interval_ms = dev->min_interval_ms;
+    st->update_ns = ktime_get_ns();
+    st->last_cpu = dev->last_cpu;
+    st->last_flags = dev->last_flags;
+    st->last_interval_ns = dev->last_interval_ns;
+    st->cycles_mult = simplechar_cycles_mult;
+    st->cycles_shift = simplechar_cycles_shift;
+    st->clock = dev->clock;
+    smp_wmb();
+    WRITE_ONCE(st->seq, st->seq + 1);
+    spin_unlock(&dev->stats_lock);
+}
+
+/*
+ * Time get_cycles() against CLOCK_MONOTONIC across a short sleep on one
+ * CPU and derive a mult/shift pair for cycles -> ns, the way clocksources
+ * do. The rate is taken in kHz so fast counters still fit in 32 bits.
+ */
+static void simplechar_calibrate(void)
+{
+    cycles_t c0, c1;
+    u64 t0, t1, khz;
+
+    migrate_disable();
+    preempt_disable();
+    t0 = ktime_get_ns();
+    c0 = get_cycles();
+    preempt_enable();
+    msleep(CALIBRATE_MS);
+    preempt_disable();
+    t1 = ktime_get_ns();
+    c1 = get_cycles();
+    preempt_enable();
+    migrate_enable();
+
+    khz = c1 > c0 ? div64_u64((u64)(c1 - c0) * NSEC_PER_MSEC, t1 - t0) : 0;
+    if (khz == 0 || khz > U32_MAX) {
+        printk(KERN_WARNING "simplechar: get_cycles() unusable, interval_ns disabled\n");
+        return;
+    }
+    clocks_calc_mult_shift(&simplechar_cycles_mult, &simplechar_cycles_shift,
+                           khz, NSEC_PER_MSEC, 600);
+    printk(KERN_INFO "simplechar: get_cycles() runs at %llu kHz\n", khz);
+}
+
+static u64 simplechar_cycles_to_ns(cycles_t cycles)
+{
+    return mul_u64_u32_shr(cycles, simplechar_cycles_mult, simplechar_cycles_shift);
+}
+
+/* Flags for a cycle diff that ends on cpu. */
+static u32 simplechar_sample_flags(struct simplechar_dev *dev, int cpu)
+{
+    u32 flags = 0;
+
+    // Counters on different CPUs need not agree, and the first read has no base.
+    if (cpu != dev->last_cpu)
+        flags |= SIMPLECHAR_JIFFIES_MIGRATED;
+    if (!simplechar_cycles_mult)
+        flags |= SIMPLECHAR_JIFFIES_UNSTABLE;
+#ifdef CONFIG_X86
+    if (check_tsc_unstable())
+        flags |= SIMPLECHAR_JIFFIES_UNSTABLE;
+#endif
+    return flags;
+}
+
+static void simplechar_trace_event(struct simplechar_dev *dev, u8 type, size_t bytes)
+{
+    struct simplechar_trace_cpu *tc;
+    struct simplechar_event *e;
+    unsigned long head;
+
+    if (!simplechar_trace)
+        return;
+
+    tc = get_cpu_ptr(simplechar_trace);
+    head = tc->head;
+    if (head - smp_load_acquire(&tc->tail) >= trace_events) {
+        tc->dropped++;
+        put_cpu_ptr(simplechar_trace);
+        return;
+    }
+    e = &tc->ev[head & (trace_events - 1)];
+    e->mono_ns = ktime_get_ns();
+    e->cycles = get_cycles();
+    e->jiffies = get_jiffies_64();
+    e->bytes = min_t(size_t, bytes, U32_MAX);
+    e->cpu = smp_processor_id();
+    e->type = type;
+    e->dev = MINOR(dev->cdev.dev);
+    smp_store_release(&tc->head, head + 1);
+    put_cpu_ptr(simplechar_trace);
+}
+
+/*
+ * Drain whole events into the iterator, merging the per-CPU rings by
+ * mono_ns. Events are staged a page at a time.
+ */
+static ssize_t simplechar_trace_read(struct iov_iter *to)
+{
+    size_t batch = PAGE_SIZE / sizeof(struct simplechar_event);
+    struct simplechar_trace_cpu *tc, *next;
+    struct simplechar_event *buf, *e;
+    size_t max_events = iov_iter_count(to) / sizeof(*buf);
+    size_t n, done = 0;
+    ssize_t err = 0;
+    int cpu;
+
+    if (!simplechar_trace)
+        return 0;
+    if (max_events == 0)
+        return -EINVAL;
+
+    buf = (struct simplechar_event *)__get_free_page(GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&simplechar_trace_lock);
+    while (done < max_events) {
+        for (n = 0; n < batch && done + n < max_events; n++) {
+            next = NULL;
+            e = NULL;
+            for_each_possible_cpu(cpu) {
+                tc = per_cpu_ptr(simplechar_trace, cpu);
+                if (tc->tail == smp_load_acquire(&tc->head))
+                    continue;
+                if (!next || tc->ev[tc->tail & (trace_events - 1)].mono_ns < e->mono_ns) {
+                    next = tc;
+                    e = &tc->ev[tc->tail & (trace_events - 1)];
+                }
+            }
+            if (!next)
+                break;
+            buf[n] = *e;
+            // Free the slot only after copying it out.
+            smp_store_release(&next->tail, next->tail + 1);
+        }
+        if (n == 0)
+            break;
+        if (copy_to_iter(buf, n * sizeof(*buf), to) != n * sizeof(*buf)) {
+            err = -EFAULT;
+            break;
+        }
+        done += n;
+        if (n < batch)
+            break;
+    }
+    mutex_unlock(&simplechar_trace_lock);
+
+    free_page((unsigned long)buf);
+    return done ? done * sizeof(*buf) : err;
+}
+
+static u64 simplechar_trace_dropped(void)
+{
+    u64 dropped = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        dropped += READ_ONCE(per_cpu_ptr(simplechar_trace, cpu)->dropped);
+    return dropped;
+}
+
+static int simplechar_trace_init(void)
+{
+    struct simplechar_trace_cpu *tc;
+    int cpu;
+
+    if (trace_events == 0)
+        return 0;
+    trace_events = roundup_pow_of_two(trace_events);
+
+    simplechar_trace = alloc_percpu(struct simplechar_trace_cpu);
+    if (!simplechar_trace)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        tc = per_cpu_ptr(simplechar_trace, cpu);
+        tc->ev = vmalloc_node(array_size(trace_events, sizeof(*tc->ev)), cpu_to_node(cpu));
+        if (!tc->ev)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+static void simplechar_trace_exit(void)
+{
+    int cpu;
+
+    if (!simplechar_trace)
+        return;
+    for_each_possible_cpu(cpu)
+        vfree(per_cpu_ptr(simplechar_trace, cpu)->ev);
+    free_percpu(simplechar_trace);
+    simplechar_trace = NULL;
+}
+
+static u64 simplechar_clock_ns(int clock)
+{
+    switch (clock) {
+    case SIMPLECHAR_CLOCK_JIFFIES:
+        return jiffies64_to_nsecs(get_jiffies_64());
+    case SIMPLECHAR_CLOCK_COARSE:
+        return ktime_get_coarse_ns();
+    case SIMPLECHAR_CLOCK_MONO_FAST:
+        return ktime_get_mono_fast_ns();
+    case SIMPLECHAR_CLOCK_RAW:
+        return ktime_get_raw_ns();
+    case SIMPLECHAR_CLOCK_BOOT:
+        return ktime_get_boottime_ns();
+    default:
+        return ktime_get_ns();
+    }
+}
+
+struct simplechar_bench_cpu {
+    u32 loops;
+    u64 cost_ps[SIMPLECHAR_CLOCK_COUNT];
+    u64 resolution_ns[SIMPLECHAR_CLOCK_COUNT];
+};
+
+/* Each clock gets its own copy of the loop so the switch is not timed. */
+#define SIMPLECHAR_BENCH_LOOP(read)                  \
+    do {                                             \
+        prev = (read);                               \
+        for (i = 0; i < b->loops; i++) {             \
+            now = (read);                            \
+            if (now != prev && now - prev < res)     \
+                res = now - prev;                    \
+            prev = now;                              \
+        }                                            \
+    } while (0)
+
+/* Runs on the CPU being measured, from smp_call_on_cpu(). */
+static int simplechar_bench_fn(void *arg)
+{
+    struct simplechar_bench_cpu *b = arg;
+    u64 t0, t1, prev, now, res;
+    int clock;
+    u32 i;
+
+    for (clock = 0; clock < SIMPLECHAR_CLOCK_COUNT; clock++) {
+        res = U64_MAX;
+        preempt_disable();
+        t0 = ktime_get_ns();
+        switch (clock) {
+        case SIMPLECHAR_CLOCK_JIFFIES:
+            SIMPLECHAR_BENCH_LOOP(jiffies64_to_nsecs(get_jiffies_64()));
+            break;
+        case SIMPLECHAR_CLOCK_COARSE:
+            SIMPLECHAR_BENCH_LOOP(ktime_get_coarse_ns());
+            break;
+        case SIMPLECHAR_CLOCK_MONO_FAST:
+            SIMPLECHAR_BENCH_LOOP(ktime_get_mono_fast_ns());
+            break;
+        case SIMPLECHAR_CLOCK_RAW:
+            SIMPLECHAR_BENCH_LOOP(ktime_get_raw_ns());
+            break;
+        case SIMPLECHAR_CLOCK_BOOT:
+            SIMPLECHAR_BENCH_LOOP(ktime_get_boottime_ns());
+            break;
+        default:
+            SIMPLECHAR_BENCH_LOOP(ktime_get_ns());
+            break;
+        }
+        t1 = ktime_get_ns();
+        preempt_enable();
+
+        b->cost_ps[clock] = div_u64((t1 - t0) * 1000, b->loops);
+        b->resolution_ns[clock] = res == U64_MAX ? 0 : res;
+        cond_resched();
+    }
+    return 0;
+}
+
+static int simplechar_clock_bench(struct simplechar_clock_bench *out)
+{
+    struct simplechar_bench_cpu *b;
+    struct simplechar_clock_cost *c;
+    int cpu, clock;
+
+    if (out->loops == 0)
+        out->loops = BENCH_LOOPS;
+    if (out->loops > BENCH_MAX_LOOPS)
+        return -EINVAL;
+
+    b = kmalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+
+    out->cpus = 0;
+    memset(out->clock, 0, sizeof(out->clock));
+    cpus_read_lock();
+    for_each_online_cpu(cpu) {
+        b->loops = out->loops;
+        if (smp_call_on_cpu(cpu, simplechar_bench_fn, b, false))
+            continue;
+        out->cpus++;
+        for (clock = 0; clock < SIMPLECHAR_CLOCK_COUNT; clock++) {
+            c = &out->clock[clock];
+            c->cost_ps_avg += b->cost_ps[clock];
+            c->cost_ps_max = max(c->cost_ps_max, b->cost_ps[clock]);
+            if (b->resolution_ns[clock] &&
+                (!c->resolution_ns || b->resolution_ns[clock] < c->resolution_ns))
+                c->resolution_ns = b->resolution_ns[clock];
+        }
+    }
+    cpus_read_unlock();
+    kfree(b);
+
+    if (out->cpus)
+        for (clock = 0; clock < SIMPLECHAR_CLOCK_COUNT; clock++)
+            out->clock[clock].cost_ps_avg = div_u64(out->clock[clock].cost_ps_avg, out->cpus);
+    return 0;
+}
+
+struct simplechar_skew_sample {
+    cycles_t cycles;
+    u64 mono_ns;
+};
+
+/* Best estimate for one CPU from one pass. */
+struct simplechar_skew_pass {
+    s64 cycles_offset;
+    s64 mono_offset_ns;
+    u64 rtt_ns;
+    u64 at_ns; // reference mono time of the best round trip
+};
+
+struct simplechar_skew_work {
+    u32 rounds;
+    struct simplechar_skew_pass *pass; // the pass being run, indexed by cpu
+    struct cpumask *seen; // CPUs the pass measured, the reference included
+    u32 *backwards;
+};
+
+/* IPI handler, runs on the remote CPU. */
+static void simplechar_skew_remote(void *arg)
+{
+    struct simplechar_skew_sample *s = arg;
+
+    s->cycles = get_cycles();
+    s->mono_ns = ktime_get_ns();
+}
+
+/*
+ * Bracket a remote read between two local reads, keeping the fastest
+ * round trip. A remote value outside [t0, t1] can only come from a
+ * clock that is behind or ahead by more than the round trip.
+ */
+static void simplechar_skew_pass(struct simplechar_skew_work *w, int cpu,
+                                 struct simplechar_skew_pass *p)
+{
+    struct simplechar_skew_sample s;
+    cycles_t c0, c1;
+    u64 m0, m1;
+    u32 i;
+
+    p->rtt_ns = U64_MAX;
+    for (i = 0; i < w->rounds; i++) {
+        preempt_disable();
+        c0 = get_cycles();
+        m0 = ktime_get_ns();
+        smp_call_function_single(cpu, simplechar_skew_remote, &s, 1);
+        m1 = ktime_get_ns();
+        c1 = get_cycles();
+        preempt_enable();
+
+        if ((s64)(s.cycles - c0) < 0 || (s64)(c1 - s.cycles) < 0 ||
+            s.mono_ns < m0 || s.mono_ns > m1)
+            w->backwards[cpu]++;
+        if (m1 - m0 < p->rtt_ns) {
+            p->rtt_ns = m1 - m0;
+            p->cycles_offset = (s64)(s.cycles - (c0 + (c1 - c0) / 2));
+            p->mono_offset_ns = (s64)(s.mono_ns - (m0 + (m1 - m0) / 2));
+            p->at_ns = m0;
+        }
+        cond_resched();
+    }
+}
+
+/* One pass over the online CPUs. Runs on the reference CPU, from smp_call_on_cpu(). */
+static int simplechar_skew_fn(void *arg)
+{
+    struct simplechar_skew_work *w = arg;
+    int self = smp_processor_id();
+    int cpu;
+
+    cpumask_set_cpu(self, w->seen);
+    for_each_online_cpu(cpu) {
+        if (cpu == self)
+            continue;
+        simplechar_skew_pass(w, cpu, &w->pass[cpu]);
+        cpumask_set_cpu(cpu, w->seen);
+    }
+    return 0;
+}
+
+/*
+ * Run one pass with the hotplug lock held for that pass only. Returns
+ * -ENODEV if the reference CPU has gone offline since the first pass.
+ */
+static int simplechar_skew_run(struct simplechar_skew_work *w, int ref,
+                               struct simplechar_skew_pass *pass, struct cpumask *seen)
+{
+    int err = -ENODEV;
+
+    w->pass = pass;
+    w->seen = seen;
+    cpus_read_lock();
+    if (cpu_online(ref))
+        err = smp_call_on_cpu(ref, simplechar_skew_fn, w, false);
+    cpus_read_unlock();
+    return err;
+}
+
+/* Change of an offset in ns over elapsed_ns, in parts per billion. */
+static s64 simplechar_drift_ppb(s64 delta_ns, u64 elapsed_ns)
+{
+    u64 elapsed_us = div_u64(elapsed_ns, NSEC_PER_USEC);
+
+    if (!elapsed_us)
+        return 0;
+    return div64_s64(delta_ns * NSEC_PER_USEC, elapsed_us);
+}
+
+static s64 simplechar_cycles_to_ns_signed(s64 cycles)
+{
+    return cycles < 0 ? -(s64)simplechar_cycles_to_ns(-cycles) : simplechar_cycles_to_ns(cycles);
+}
+
+static int simplechar_skew_check(struct simplechar_skew *out)
+{
+    struct simplechar_skew_cpu __user *ucpu = u64_to_user_ptr(out->cpus);
+    struct simplechar_skew_pass *first, *second, *p, *q;
+    struct simplechar_skew_cpu *res, *c;
+    struct simplechar_skew_work w;
+    cpumask_var_t seen_first, seen_second;
+    s64 min_c = 0, max_c = 0, min_m = 0, max_m = 0;
+    bool drift = false;
+    u64 elapsed;
+    u32 n = 0;
+    int cpu, ref, err;
+
+    if (out->rounds == 0)
+        out->rounds = SKEW_ROUNDS;
+    if (out->rounds > SKEW_MAX_ROUNDS || out->interval_ms > SKEW_MAX_INTERVAL_MS)
+        return -EINVAL;
+
+    if (!zalloc_cpumask_var(&seen_first, GFP_KERNEL))
+        return -ENOMEM;
+    if (!zalloc_cpumask_var(&seen_second, GFP_KERNEL)) {
+        free_cpumask_var(seen_first);
+        return -ENOMEM;
+    }
+    w.rounds = out->rounds;
+    first = kvcalloc(nr_cpu_ids, sizeof(*first), GFP_KERNEL);
+    second = kvcalloc(nr_cpu_ids, sizeof(*second), GFP_KERNEL);
+    w.backwards = kvcalloc(nr_cpu_ids, sizeof(*w.backwards), GFP_KERNEL);
+    res = kvcalloc(nr_cpu_ids, sizeof(*res), GFP_KERNEL);
+    if (!first || !second || !w.backwards || !res) {
+        err = -ENOMEM;
+        goto out_free;
+    }
+
+    // Hotplug is only held off for one pass at a time, never across the interval.
+    ref = cpumask_first(cpu_online_mask);
+    out->ref_cpu = ref;
+    err = simplechar_skew_run(&w, ref, first, seen_first);
+    if (err)
+        goto out_free;
+    if (out->interval_ms) {
+        if (msleep_interruptible(out->interval_ms)) {
+            err = -EINTR;
+            goto out_free;
+        }
+        // Without the reference CPU the second pass has nothing to compare against.
+        drift = simplechar_skew_run(&w, ref, second, seen_second) == 0;
+    }
+
+    out->backwards = 0;
+    for_each_cpu(cpu, seen_first) {
+        p = &first[cpu];
+        q = &second[cpu];
+        c = &res[n++];
+        c->cpu = cpu;
+        c->backwards = w.backwards[cpu];
+        c->cycles_offset = p->cycles_offset;
+        c->mono_offset_ns = p->mono_offset_ns;
+        if (cpu != ref) {
+            c->rtt_ns = p->rtt_ns;
+            // Only CPUs measured in both passes have a drift.
+            if (drift && cpumask_test_cpu(cpu, seen_second)) {
+                elapsed = q->at_ns - p->at_ns;
+                c->cycles_drift_ppb = simplechar_drift_ppb(
+                    simplechar_cycles_to_ns_signed(q->cycles_offset - p->cycles_offset), elapsed);
+                c->mono_drift_ppb = simplechar_drift_ppb(q->mono_offset_ns - p->mono_offset_ns,
+                                                         elapsed);
+            }
+        }
+        min_c = min(min_c, c->cycles_offset);
+        max_c = max(max_c, c->cycles_offset);
+        min_m = min(min_m, c->mono_offset_ns);
+        max_m = max(max_m, c->mono_offset_ns);
+        out->backwards += c->backwards;
+    }
+
+    if (copy_to_user(ucpu, res, array_size(min(n, out->ncpus), sizeof(*res))))
+        err = -EFAULT;
+    out->ncpus = n;
+    out->max_skew_cycles = max_c - min_c;
+    out->max_skew_ns = max_m - min_m;
+out_free:
+    kvfree(res);
+    kvfree(w.backwards);
+    kvfree(second);
+    kvfree(first);
+    free_cpumask_var(seen_second);
+    free_cpumask_var(seen_first);
+    return err;
+}
+
+/* Take a token. Returns 0 on success or the ns until one is due. */
+static u64 simplechar_rate_take(struct simplechar_file *f, u64 now)
+{
+    u64 emission = READ_ONCE(f->emission_ns);
+    u64 tolerance = READ_ONCE(f->tolerance_ns);
+    s64 tat = atomic64_read(&f->tat);
+    u64 start;
+
+    if (!emission)
+        return 0;
+    do {
+        start = max_t(u64, tat, now);
+        if (start - now > tolerance)
+            return start - now - tolerance;
+    } while (!atomic64_try_cmpxchg(&f->tat, &tat, start + emission));
+    return 0;
+}
+
+/* Wait for a token if the file blocks, else fail with -EAGAIN. */
+static int simplechar_rate_wait(struct simplechar_file *f, bool nowait)
+{
+    ktime_t wait;
+    u64 ns;
+
+    while ((ns = simplechar_rate_take(f, ktime_get_ns())) != 0) {
+        if (nowait || !READ_ONCE(f->block))
+            return -EAGAIN;
+        wait = ns_to_ktime(ns);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&wait, HRTIMER_MODE_REL);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static int simplechar_rate_set(struct simplechar_file *f, const struct simplechar_rate *r)
+{
+    u64 emission;
+
+    if (r->flags & ~SIMPLECHAR_RATE_BLOCK)
+        return -EINVAL;
+    if (r->rate > NSEC_PER_SEC)
+        return -EINVAL;
+
+    emission = r->rate ? div64_u64(NSEC_PER_SEC, r->rate) : 0;
+    WRITE_ONCE(f->emission_ns, emission);
+    WRITE_ONCE(f->tolerance_ns, (u64)(max(r->burst, 1U) - 1) * emission);
+    WRITE_ONCE(f->block, r->flags & SIMPLECHAR_RATE_BLOCK);
+    // Start with a full bucket.
+    atomic64_set(&f->tat, 0);
+    return 0;
+}
 
 static int simplechar_open(struct inode *inode, struct file *filp)
 {
-    filp->private_data = &simplechar_device;
-    printk(KERN_INFO "simplechar: Opened device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    struct simplechar_file *f;
+
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f)
+        return -ENOMEM;
+    f->dev = container_of(inode->i_cdev, struct simplechar_dev, cdev);
+    atomic64_set(&f->tat, 0);
+    filp->private_data = f;
+    trace_simplechar_open(MINOR(inode->i_rdev));
+    simplechar_dbg("Opened device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
     return 0;
 }
 
 static int simplechar_release(struct inode *inode, struct file *filp)
 {
-    printk(KERN_INFO "simplechar: Released device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    kfree(filp->private_data);
+    trace_simplechar_release(MINOR(inode->i_rdev));
+    simplechar_dbg("Released device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
     return 0;
 }
 
-static ssize_t simplechar_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t simplechar_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    struct simplechar_dev *dev = filp->private_data;
+    struct file *filp = iocb->ki_filp;
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    bool nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
     unsigned long curr_jiffies = jiffies;
     cycles_t curr_cycles;
     unsigned long jiffies_diff_ms;
+    u64 interval_ns;
+    u32 flags;
+    int cpu;
     struct timespec64 tv, ts;
+    int clock = READ_ONCE(dev->clock);
+    u64 clock_ns = 0;
     char tmp_buf[BUFFER_SIZE];
     int len;
     ssize_t retval = 0;
-    printk(KERN_INFO "simplechar: 1\n");
 
-    if (dev->size == 0) {
-        printk(KERN_INFO "simplechar: no data\n");
+    if (f->trace_stream)
+        return simplechar_trace_read(to);
+
+    if (ring_mode ? !simplechar_ring_used(&dev->ring) : dev->size == 0) {
+        simplechar_dbg("no data\n");
         return 0;
     }
 
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-    printk(KERN_INFO "simplechar: 2\n");
+    if (!ring_mode) {
+        // Each read moves *f_pos by the text length, so it soon passes size.
+        if (*f_pos >= dev->size)
+            return 0;
+        count = min_t(size_t, count, dev->size - *f_pos);
+    }
+
+    // Перевіряємо інтервал лише якщо він встановлений
+    if (dev->interval_set && time_before(curr_jiffies, dev->last_jiffies + msecs_to_jiffies(dev->min_interval_ms))) {
+        simplechar_dbg("Read too soon, interval %lu ms not elapsed\n", dev->min_interval_ms);
+        return -EAGAIN;
+    }
 
+    // Only a read the interval lets through spends a token.
+    retval = simplechar_rate_wait(f, nowait);
+    if (retval)
+        return retval;
+
+    // Sample after any wait for a token, so the sample is when the read happens.
+    curr_jiffies = jiffies;
     preempt_disable();
     curr_cycles = get_cycles();
+    cpu = smp_processor_id();
     preempt_enable();
-    printk(KERN_INFO "simplechar: 3\n");
-
+    interval_ns = simplechar_cycles_to_ns(curr_cycles - dev->last_cycles);
+    flags = simplechar_sample_flags(dev, cpu);
     jiffies_diff_ms = jiffies_to_msecs((long)curr_jiffies - (long)dev->last_jiffies);
-    // Перевіряємо інтервал лише якщо він встановлений
-    if (dev->interval_set && time_before(curr_jiffies, dev->last_jiffies + msecs_to_jiffies(dev->min_interval_ms))) {
-        printk(KERN_INFO "simplechar: Read too soon, interval %lu ms not elapsed\n", dev->min_interval_ms);
-        return -EAGAIN;
+
+    // In ring mode reads stream the raw data; the interval still applies.
+    if (ring_mode) {
+        retval = simplechar_ring_read(&dev->ring, to, count);
+        if (retval > 0) {
+            dev->last_jiffies = curr_jiffies;
+            dev->last_cycles = curr_cycles;
+            dev->last_cpu = cpu;
+            dev->last_flags = flags;
+            dev->last_interval_ns = interval_ns;
+            dev->interval_set = true;
+            simplechar_stats_publish(dev);
+            simplechar_trace_event(dev, SIMPLECHAR_EVENT_READ, retval);
+            trace_simplechar_sample(MINOR(dev->cdev.dev), cpu, curr_jiffies, interval_ns, flags);
+        }
+        trace_simplechar_read(MINOR(dev->cdev.dev), *f_pos, retval);
+        return retval;
     }
-    printk(KERN_INFO "simplechar: 4\n");
 
-    ktime_get_ts64(&tv);
-    ktime_get_real_ts64(&ts);
-    printk(KERN_INFO "simplechar: 5\n");
+    if (clock == SIMPLECHAR_CLOCK_DEFAULT) {
+        ktime_get_ts64(&tv);
+        ktime_get_real_ts64(&ts);
+    } else {
+        clock_ns = simplechar_clock_ns(clock);
+    }
 
-    len = snprintf(tmp_buf, BUFFER_SIZE,
+    len = scnprintf(tmp_buf, BUFFER_SIZE,
                    "jiffies: %lu\n"
                    "jiffies_diff_ms: %lu\n"
                    "cycles_diff: %llu\n"
-                   "timeval: %ld.%09ld\n"
-                   "timespec: %ld.%09ld\n"
-                   "data: %.*s\n",
+                   "interval_ns: %llu\n"
+                   "cpu: %d\n"
+                   "prev_cpu: %d\n"
+                   "flags:%s%s\n",
                    curr_jiffies, jiffies_diff_ms,
                    (unsigned long long)(curr_cycles - dev->last_cycles),
-                   tv.tv_sec, tv.tv_nsec,
-                   ts.tv_sec, ts.tv_nsec,
-                   (int)count, dev->data + *f_pos);
+                   interval_ns, cpu, dev->last_cpu,
+                   flags & SIMPLECHAR_JIFFIES_MIGRATED ? " migrated" : "",
+                   flags & SIMPLECHAR_JIFFIES_UNSTABLE ? " unstable" : "");
+    if (clock == SIMPLECHAR_CLOCK_DEFAULT)
+        len += scnprintf(tmp_buf + len, BUFFER_SIZE - len,
+                         "timeval: %ld.%09ld\n"
+                         "timespec: %ld.%09ld\n",
+                         tv.tv_sec, tv.tv_nsec,
+                         ts.tv_sec, ts.tv_nsec);
+    else
+        len += scnprintf(tmp_buf + len, BUFFER_SIZE - len,
+                         "clock: %s\n"
+                         "clock_ns: %llu\n",
+                         simplechar_clock_names[clock], clock_ns);
+    len += scnprintf(tmp_buf + len, BUFFER_SIZE - len,
+                     "data: %.*s\n",
+                     (int)min_t(size_t, count, BUFFER_SIZE - *f_pos), dev->data + *f_pos);
 
-    if (copy_to_user(buf, tmp_buf, len)) {
-        printk(KERN_ERR "simplechar: Failed to copy data to user\n");
+    len = min_t(size_t, len, iov_iter_count(to));
+    if (copy_to_iter(tmp_buf, len, to) != len) {
+        simplechar_dbg("Failed to copy data to user\n");
         return -EFAULT;
     }
 
     dev->last_jiffies = curr_jiffies;
     dev->last_cycles = curr_cycles;
+    dev->last_cpu = cpu;
+    dev->last_flags = flags;
+    dev->last_interval_ns = interval_ns;
     dev->interval_set = true; // Позначаємо, що інтервал тепер активний
+    simplechar_stats_publish(dev);
+    simplechar_trace_event(dev, SIMPLECHAR_EVENT_READ, len);
+    trace_simplechar_sample(MINOR(dev->cdev.dev), cpu, curr_jiffies, interval_ns, flags);
+    trace_simplechar_read(MINOR(dev->cdev.dev), *f_pos, len);
     *f_pos += len;
     retval = len;
-    printk(KERN_INFO "simplechar: Read %d bytes from pos %lld\n", len, *f_pos);
+    simplechar_dbg("Read %d bytes from pos %lld\n", len, *f_pos);
     return retval;
 }
 
-static ssize_t simplechar_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t simplechar_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct simplechar_dev *dev = filp->private_data;
-    char tmp_buf[BUFFER_SIZE];
-    unsigned long new_interval;
+    struct simplechar_file *f = iocb->ki_filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    size_t count = iov_iter_count(from);
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos = *f_pos;
     ssize_t retval = 0;
 
-    if (*f_pos + count > BUFFER_SIZE) {
-        count = BUFFER_SIZE - *f_pos;
-        if (count == 0) {
-            printk(KERN_ERR "simplechar: Buffer full\n");
+    if (ring_mode) {
+        retval = simplechar_ring_write(&dev->ring, from, count);
+        if (retval < 0)
+            return retval;
+        count = retval;
+    } else {
+        // Checked before the clamp: past the end, BUFFER_SIZE - *f_pos would wrap.
+        if (*f_pos >= BUFFER_SIZE) {
+            simplechar_dbg("Buffer full\n");
             return -ENOSPC;
         }
+        count = min_t(size_t, count, BUFFER_SIZE - *f_pos);
+        count = copy_from_iter(dev->data + *f_pos, count, from);
+        if (count == 0) {
+            simplechar_dbg("Failed to copy data from user\n");
+            return -EFAULT;
+        }
+        *f_pos += count;
+        if (dev->size < *f_pos)
+            dev->size = *f_pos;
     }
+    simplechar_stats_publish(dev);
+    simplechar_trace_event(dev, SIMPLECHAR_EVENT_WRITE, count);
+    retval = count;
+    trace_simplechar_write(MINOR(dev->cdev.dev), pos, count);
+    simplechar_dbg("Wrote %zd bytes to pos %lld\n", count, *f_pos);
+    return retval;
+}
 
-    if (copy_from_user(tmp_buf, buf, count)) {
-        printk(KERN_ERR "simplechar: Failed to copy data from user\n");
-        return -EFAULT;
-    }
-    tmp_buf[count] = '\0';
+static long simplechar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    void __user *argp = (void __user *)arg;
+    struct simplechar_jiffies_stats st;
+    struct simplechar_clock_bench bench;
+    struct simplechar_skew skew;
+    struct simplechar_rate rate;
+    u32 val32;
+    u64 val;
+    int err;
 
-    if (strncmp(tmp_buf, "reset", 5) == 0) {
+    switch (cmd) {
+    case SIMPLECHAR_IOC_RESET:
         dev->last_jiffies = jiffies - msecs_to_jiffies(dev->min_interval_ms) - 1; // Дозволяємо зчитування після reset
         preempt_disable();
         dev->last_cycles = get_cycles();
+        dev->last_cpu = smp_processor_id();
         preempt_enable();
-        printk(KERN_INFO "simplechar: Reset jiffies and cycles\n");
-        return count;
-    }
+        simplechar_ring_reset(&dev->ring);
+        simplechar_stats_publish(dev);
+        simplechar_dbg("Reset jiffies and cycles\n");
+        return 0;
 
-    if (sscanf(tmp_buf, "interval=%lu", &new_interval) == 1) {
-        dev->min_interval_ms = new_interval;
+    case SIMPLECHAR_JIFFIES_GET_STATS:
+        spin_lock(&dev->stats_lock);
+        st = *dev->stats;
+        spin_unlock(&dev->stats_lock);
+        return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+
+    case SIMPLECHAR_JIFFIES_SET_INTERVAL:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > UINT_MAX)
+            return -EINVAL;
+        dev->min_interval_ms = val;
         dev->last_jiffies = jiffies; // Ініціалізуємо last_jiffies при встановленні інтервалу
         dev->interval_set = true; // Позначаємо, що інтервал встановлено
-        printk(KERN_INFO "simplechar: Set interval to %lu ms\n", new_interval);
-        return count;
+        simplechar_stats_publish(dev);
+        simplechar_dbg("Set interval to %llu ms\n", val);
+        return 0;
+
+    case SIMPLECHAR_JIFFIES_SET_CLOCK:
+        if (get_user(val32, (u32 __user *)argp))
+            return -EFAULT;
+        if (val32 >= SIMPLECHAR_CLOCK_COUNT)
+            return -EINVAL;
+        WRITE_ONCE(dev->clock, val32);
+        simplechar_stats_publish(dev);
+        return 0;
+
+    case SIMPLECHAR_JIFFIES_SET_RATE:
+        if (copy_from_user(&rate, argp, sizeof(rate)))
+            return -EFAULT;
+        return simplechar_rate_set(f, &rate);
+
+    case SIMPLECHAR_JIFFIES_TRACE_STREAM:
+        if (get_user(val32, (u32 __user *)argp))
+            return -EFAULT;
+        WRITE_ONCE(f->trace_stream, val32 != 0);
+        return 0;
+
+    case SIMPLECHAR_JIFFIES_TRACE_DROPPED:
+        val = simplechar_trace ? simplechar_trace_dropped() : 0;
+        return put_user(val, (u64 __user *)argp);
+
+    case SIMPLECHAR_JIFFIES_CLOCK_BENCH:
+        // Runs preempt-off loops on every CPU.
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&bench, argp, sizeof(bench)))
+            return -EFAULT;
+        err = simplechar_clock_bench(&bench);
+        if (err)
+            return err;
+        return copy_to_user(argp, &bench, sizeof(bench)) ? -EFAULT : 0;
+
+    case SIMPLECHAR_JIFFIES_SKEW_CHECK:
+        // Sends IPIs to every CPU for as long as the caller asks.
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&skew, argp, sizeof(skew)))
+            return -EFAULT;
+        err = simplechar_skew_check(&skew);
+        if (err)
+            return err;
+        return copy_to_user(argp, &skew, sizeof(skew)) ? -EFAULT : 0;
     }
 
-    memcpy(dev->data + *f_pos, tmp_buf, count);
-    *f_pos += count;
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
-    retval = count;
-    printk(KERN_INFO "simplechar: Wrote %zd bytes to pos %lld\n", count, *f_pos);
-    return retval;
+    return -ENOTTY;
 }
 
 static loff_t simplechar_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct simplechar_dev *dev = filp->private_data;
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
     loff_t newpos;
     switch (whence) {
     case 0: // SEEK_SET
@@ -180,44 +1032,124 @@ static loff_t simplechar_llseek(struct file *filp, loff_t off, int whence)
     return newpos;
 }
 
+/*
+ * Map the data page and/or the stats page read-only, see simplechar.h.
+ */
+static int simplechar_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct simplechar_file *f = filp->private_data;
+
+    return simplechar_mmap_pages(vma, f->dev->data, f->dev->stats);
+}
+
 static struct file_operations simplechar_fops = {
     .owner = THIS_MODULE,
     .open = simplechar_open,
     .release = simplechar_release,
-    .read = simplechar_read,
-    .write = simplechar_write,
-    .llseek = simplechar_llseek
+    .read_iter = simplechar_read_iter,
+    .write_iter = simplechar_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = simplechar_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = simplechar_llseek,
+    .mmap = simplechar_mmap
 };
 
-static int __init simplechar_init(void)
+static struct simplechar_dev *simplechar_create_dev(int index)
 {
+    int node = simplechar_dev_node(index);
+    dev_t devno = MKDEV(MAJOR(simplechar_devno), index);
+    struct simplechar_dev *dev;
     int err;
 
-    printk(KERN_INFO "simplechar: Initializing module\n");
-
-    err = alloc_chrdev_region(&simplechar_devno, 0, 1, "simplechartest");
-    if (err < 0) {
-        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
-        return err;
-    }
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
 
-    simplechar_device.data = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!simplechar_device.data) {
+    BUILD_BUG_ON(BUFFER_SIZE > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct simplechar_jiffies_stats) > PAGE_SIZE);
+    dev->data = simplechar_alloc_page(node);
+    dev->stats = simplechar_alloc_page(node);
+    if (!dev->data || !dev->stats) {
         printk(KERN_ERR "simplechar: Failed to allocate buffer\n");
         err = -ENOMEM;
         goto fail_alloc;
     }
-    simplechar_device.size = 0;
-    simplechar_device.min_interval_ms = 0;
-    simplechar_device.interval_set = false; // false
-    memset(simplechar_device.data, 0, BUFFER_SIZE);
+    spin_lock_init(&dev->stats_lock);
+    dev->last_cpu = -1;
+    simplechar_stats_publish(dev);
+    simplechar_ring_init(&dev->ring, simplechar_ring_cache, (size_t)ring_cap_kb * 1024);
 
-    cdev_init(&simplechar_device.cdev, &simplechar_fops);
-    simplechar_device.cdev.owner = THIS_MODULE;
-    err = cdev_add(&simplechar_device.cdev, simplechar_devno, 1);
+    cdev_init(&dev->cdev, &simplechar_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
     if (err) {
         printk(KERN_ERR "simplechar: Failed to add cdev\n");
-        goto fail_cdev;
+        goto fail_alloc;
+    }
+
+    if (num_devices == 1)
+        device_create(simplechar_class, NULL, devno, NULL, "simplechartest");
+    else
+        device_create(simplechar_class, NULL, devno, NULL, "simplechartest%d", index);
+
+    return dev;
+
+fail_alloc:
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+    return ERR_PTR(err);
+}
+
+static void simplechar_destroy_dev(struct simplechar_dev *dev)
+{
+    device_destroy(simplechar_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+    simplechar_ring_destroy(&dev->ring);
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+}
+
+static int __init simplechar_init(void)
+{
+    struct simplechar_dev *dev;
+    int err;
+    int i;
+
+    printk(KERN_INFO "simplechar: Initializing module\n");
+
+    if (num_devices < 1 || num_devices > MAX_DEVICES) {
+        printk(KERN_ERR "simplechar: num_devices must be 1..%d\n", MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    simplechar_calibrate();
+
+    err = simplechar_trace_init();
+    if (err) {
+        printk(KERN_ERR "simplechar: Failed to allocate event trace\n");
+        goto fail_trace;
+    }
+
+    simplechar_ring_cache = simplechar_ring_cache_create("simplechartest_ring");
+    if (!simplechar_ring_cache) {
+        err = -ENOMEM;
+        goto fail_trace;
+    }
+
+    simplechar_devices = kcalloc(num_devices, sizeof(*simplechar_devices), GFP_KERNEL);
+    if (!simplechar_devices) {
+        err = -ENOMEM;
+        goto fail_devices;
+    }
+
+    err = alloc_chrdev_region(&simplechar_devno, 0, num_devices, "simplechartest");
+    if (err < 0) {
+        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
+        goto fail_region;
     }
 
     simplechar_class = class_create("simplechartest");
@@ -226,29 +1158,47 @@ static int __init simplechar_init(void)
         printk(KERN_ERR "simplechar: Failed to create class\n");
         goto fail_class;
     }
-    device_create(simplechar_class, NULL, simplechar_devno, NULL, "simplechartest");
+
+    for (i = 0; i < num_devices; i++) {
+        dev = simplechar_create_dev(i);
+        if (IS_ERR(dev)) {
+            err = PTR_ERR(dev);
+            goto fail_dev;
+        }
+        simplechar_devices[i] = dev;
+    }
 
     printk(KERN_INFO "simplechar: Module initialized successfully\n");
     return 0;
 
+fail_dev:
+    while (i--)
+        simplechar_destroy_dev(simplechar_devices[i]);
+    class_destroy(simplechar_class);
 fail_class:
-    cdev_del(&simplechar_device.cdev);
-fail_cdev:
-    kfree(simplechar_device.data);
-fail_alloc:
-    unregister_chrdev_region(simplechar_devno, 1);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+fail_region:
+    kfree(simplechar_devices);
+fail_devices:
+    kmem_cache_destroy(simplechar_ring_cache);
+fail_trace:
+    simplechar_trace_exit();
     return err;
 }
 
 static void __exit simplechar_exit(void)
 {
-    device_destroy(simplechar_class, simplechar_devno);
+    int i;
+
+    for (i = 0; i < num_devices; i++)
+        simplechar_destroy_dev(simplechar_devices[i]);
     class_destroy(simplechar_class);
-    cdev_del(&simplechar_device.cdev);
-    kfree(simplechar_device.data);
-    unregister_chrdev_region(simplechar_devno, 1);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+    kfree(simplechar_devices);
+    kmem_cache_destroy(simplechar_ring_cache);
+    simplechar_trace_exit();
     printk(KERN_INFO "simplechar: Module unloaded\n");
 }
 
 module_init(simplechar_init);
-module_exit(simplechar_exit);
\ No newline at end of file
+module_exit(simplechar_exit);
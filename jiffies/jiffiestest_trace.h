@@ -0,0 +1,40 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplechar_jiffies
+
+#if !defined(_JIFFIESTEST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _JIFFIESTEST_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include <simplechar_trace.h>
+
+TRACE_EVENT(simplechar_sample,
+    TP_PROTO(unsigned int minor, int cpu, u64 jiffies, u64 interval_ns, u32 flags),
+    TP_ARGS(minor, cpu, jiffies, interval_ns, flags),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, cpu)
+        __field(u64, jiffies)
+        __field(u64, interval_ns)
+        __field(u32, flags)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cpu = cpu;
+        __entry->jiffies = jiffies;
+        __entry->interval_ns = interval_ns;
+        __entry->flags = flags;
+    ),
+    TP_printk("minor=%u cpu=%d jiffies=%llu interval_ns=%llu flags=%#x",
+              __entry->minor, __entry->cpu, __entry->jiffies,
+              __entry->interval_ns, __entry->flags)
+);
+
+#endif /* _JIFFIESTEST_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE jiffiestest_trace
+#include <trace/define_trace.h>
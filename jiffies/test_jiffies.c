@@ -3,6 +3,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "../include/simplechar.h"
 
 int main()
 {
@@ -13,8 +17,10 @@ int main()
     }
 
     char buf[1024];
+    uint64_t interval_ms = 2000;
 
-    write(fd, "interval=2000", strlen("interval=2000"));
+    if (ioctl(fd, SIMPLECHAR_JIFFIES_SET_INTERVAL, &interval_ms) < 0)
+        perror("set interval");
     write(fd, "test data", strlen("test data"));
     lseek(fd, 0, SEEK_SET);
     sleep(1);  // ще не пройшло 2 секунди
@@ -35,7 +41,8 @@ int main()
         printf("after 2s: %s\n", buf);
     }
 
-    write(fd, "reset", strlen("reset"));
+    if (ioctl(fd, SIMPLECHAR_IOC_RESET) < 0)
+        perror("reset");
     lseek(fd, 0, SEEK_SET);
     ret = read(fd, buf, 1024);
     if (ret < 0)
@@ -5,246 +5,1033 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/device.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/version.h>
 #include <linux/spinlock.h>
-#include <linux/delay.h>
+#include <linux/seqlock.h>
+#include <linux/bitops.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+
+#include <simplechar.h>
+#include <simplechar_ring.h>
+#include <simplechar_pages.h>
+#include <simplechar_debug.h>
+#include <simplechar_text.h>
+
+#define CREATE_TRACE_POINTS
+#include "timertest_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Timur");
-MODULE_DESCRIPTION("A simple char device driver with single device");
+MODULE_DESCRIPTION("A simple char device driver with one or more devices");
 MODULE_VERSION("1.0");
 
 #define BUFFER_SIZE 1024
+#define TEXT_SIZE (BUFFER_SIZE + 512) // room for the whole buffer and the counters
+#define MAX_DEVICES 256
+#define TICK_MIN_US 10 // below this the timer would mostly measure itself
+#define TICK_MAX_US (3600UL * USEC_PER_SEC)
+#define JOB_DURATION_MS 10000 // simulated length of the deferred job
+#define JOB_STEP_MS 100 // the job re-queues itself in steps this long
+
+/* Where the deferred char_count update runs, chosen at load time. */
+enum simplechar_bh_backend {
+    SIMPLECHAR_BH_TASKLET,
+    SIMPLECHAR_BH_WQ, // system_bh_wq, softirq context
+    SIMPLECHAR_BH_KTHREAD, // per-CPU SCHED_FIFO kthread_worker
+    SIMPLECHAR_BH_THREADED, // unbound high-priority workqueue
+};
+
+static const char * const simplechar_bh_names[] = {
+    [SIMPLECHAR_BH_TASKLET] = "tasklet",
+    [SIMPLECHAR_BH_WQ] = "bh_wq",
+    [SIMPLECHAR_BH_KTHREAD] = "kthread",
+    [SIMPLECHAR_BH_THREADED] = "threaded",
+};
+
+static char *bh_backend = "tasklet";
+module_param(bh_backend, charp, 0444);
+MODULE_PARM_DESC(bh_backend, "Deferred counting backend: tasklet, bh_wq, kthread or threaded");
+
+static int num_devices = 1;
+module_param(num_devices, int, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent devices; more than one are named simplechartimeN");
+
+static bool ring_mode;
+module_param(ring_mode, bool, 0444);
+MODULE_PARM_DESC(ring_mode, "Stream data through a FIFO instead of the fixed 1 KB buffer");
+
+module_param_cb(debug, &simplechar_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log opens, reads and writes to the kernel log (slow; prefer the tracepoints)");
+
+static unsigned int ring_cap_kb = 64;
+module_param(ring_cap_kb, uint, 0444);
+MODULE_PARM_DESC(ring_cap_kb, "Max data queued in ring mode, in KB");
+
+static int wq_max_active = 4;
+module_param(wq_max_active, int, 0444);
+MODULE_PARM_DESC(wq_max_active, "Max in-flight items on the deferred job workqueue");
+
+static bool wq_highpri;
+module_param(wq_highpri, bool, 0444);
+MODULE_PARM_DESC(wq_highpri, "Run deferred jobs on high-priority workers");
+
+struct simplechar_dev;
+
+struct simplechar_kwork {
+    struct kthread_work work;
+    struct simplechar_dev *dev;
+};
 
 struct simplechar_dev {
-    char *data;
+    char *data; // one page, so it can be mmap()ed
+    struct simplechar_time_stats *stats; // mmap()able mirror of the counters
+    struct simplechar_ring ring; // data store in ring_mode
     unsigned long size;
     unsigned long tick_count;
     unsigned long char_count;
+    long char_delta; // pending char_count change, applied by the bottom half
+    bool char_recount; // char_count must be rebuilt from the whole buffer
     unsigned long work_delay;
+    bool job_running;
+    unsigned long job_end; // jiffies at which the running job completes
     int log_done;
-    struct timer_list timer;
+    u64 event_gen; // bumped on every tick and job completion, never reset
+    u64 job_gen; // bumped on every job completion
+    wait_queue_head_t pollq;
+    u64 tick_period_ns;
+    ktime_t tick_next; // expected time of the next tick, running or not
+    unsigned int users; // open files; the timer only runs while non-zero
+    u64 tick_slack_ns; // expiry may be deferred this much to batch wakeups
+    u64 jitter_last_ns; // actual minus expected expiry of the last tick
+    u64 jitter_max_ns;
+    u64 jitter_sum_ns;
+    u64 jitter_samples;
+    struct hrtimer timer;
     struct tasklet_struct tasklet;
+    struct work_struct bh_work; // bh_wq and threaded backends
+    struct simplechar_kwork __percpu *kwork; // kthread backend
+    u64 bh_queued_ns; // when the pending bottom half was first scheduled
+    u64 bh_runs;
+    u64 bh_lat_last_ns; // schedule-to-run latency of the bottom half
+    u64 bh_lat_max_ns;
+    u64 bh_lat_sum_ns;
     struct delayed_work work;
-    struct workqueue_struct *wq;
-    spinlock_t lock;
+    spinlock_t lock; // data, size, char_delta/char_recount, bh_queued_ns, job_* and users
+    seqcount_spinlock_t data_seq; // lets readers copy data without the lock
+    seqlock_t stats_lock; // counters, *_gen, tick_period_ns/tick_next/tick_slack_ns, jitter_*, bh_*
+    struct simplechar_text __rcu *text; // last read() text, see simplechar_text_snapshot()
     struct cdev cdev;
 };
 
-static struct simplechar_dev simplechar_device;
+/* Per open file: the event generations this reader has already seen. */
+struct simplechar_file {
+    struct simplechar_dev *dev;
+    u64 seen_gen;
+    u64 seen_job_gen;
+    struct simplechar_text __rcu *text; // snapshot a partial read() left to continue
+};
+
+static struct simplechar_dev **simplechar_devices;
 static dev_t simplechar_devno;
 static struct class *simplechar_class;
+static struct workqueue_struct *simplechar_wq; // deferred jobs of all devices
+static enum simplechar_bh_backend simplechar_bh;
+static struct kthread_worker **simplechar_kworkers; // indexed by CPU
+static struct kthread_worker *simplechar_kworker_any; // for CPUs onlined after load
+static struct workqueue_struct *simplechar_bh_wq;
+static struct kmem_cache *simplechar_ring_cache;
 
-static void simplechar_timer_fn(struct timer_list *t);
+static enum hrtimer_restart simplechar_timer_fn(struct hrtimer *t);
 static void simplechar_tasklet_fn(unsigned long arg);
+static void simplechar_bh_work_fn(struct work_struct *work);
+static void simplechar_kwork_fn(struct kthread_work *work);
 static void simplechar_work_fn(struct work_struct *work);
 
+/*
+ * Count the non-zero bytes in buf a word at a time. For each word the
+ * expression below sets the top bit of exactly the bytes that are zero,
+ * so a popcount gives the number of zero bytes in the word.
+ */
+static size_t simplechar_count_nonzero(const char *buf, size_t len)
+{
+    const unsigned long mask = REPEAT_BYTE(0x7f);
+    size_t zeros = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+        unsigned long v;
+
+        memcpy(&v, buf + i, sizeof(v));
+        zeros += hweight_long(~(((v & mask) + mask) | v | mask));
+    }
+    for (; i < len; i++) {
+        if (buf[i] == '\0')
+            zeros++;
+    }
+
+    return len - zeros;
+}
+
+/* Mirror the counters into the mmap stats page. Caller holds stats_lock for writing. */
+static void simplechar_stats_publish(struct simplechar_dev *dev)
+{
+    struct simplechar_time_stats *st = dev->stats;
+
+    WRITE_ONCE(st->seq, st->seq + 1);
+    smp_wmb();
+    st->log_done = dev->log_done;
+    st->tick_count = dev->tick_count;
+    st->tick_period_ns = dev->tick_period_ns;
+    st->tick_next_ns = ktime_to_ns(dev->tick_next);
+    st->char_count = dev->char_count;
+    st->event_gen = dev->event_gen;
+    st->jitter_last_ns = dev->jitter_last_ns;
+    st->jitter_max_ns = dev->jitter_max_ns;
+    st->update_ns = ktime_get_ns();
+    smp_wmb();
+    WRITE_ONCE(st->seq, st->seq + 1);
+}
+
+/* Number of ticks that fell due between next and now. */
+static u64 simplechar_ticks_due(ktime_t next, u64 period, ktime_t now)
+{
+    if (ktime_before(now, next))
+        return 0;
+    return div64_u64(ktime_to_ns(ktime_sub(now, next)), period) + 1;
+}
+
+/*
+ * Credit every tick that fell due up to now, whether or not the timer
+ * was running for it. Caller holds stats_lock for writing.
+ */
+static void simplechar_tick_catchup(struct simplechar_dev *dev, ktime_t now)
+{
+    u64 ticks = simplechar_ticks_due(dev->tick_next, dev->tick_period_ns, now);
+
+    dev->tick_count += ticks;
+    dev->tick_next = ktime_add_ns(dev->tick_next, ticks * dev->tick_period_ns);
+}
+
+/*
+ * (Re)arm the timer for tick_next if anyone has the device open. Caller
+ * holds dev->lock. The callback rewrites the expiry of its own timer, so it
+ * must not be running while the timer is requeued from here.
+ */
+static void simplechar_timer_start(struct simplechar_dev *dev)
+{
+    ktime_t next;
+    unsigned int seq;
+
+    if (!dev->users)
+        return;
+
+    hrtimer_cancel(&dev->timer);
+    do {
+        seq = read_seqbegin(&dev->stats_lock);
+        next = dev->tick_next;
+    } while (read_seqretry(&dev->stats_lock, seq));
+
+    hrtimer_start_range_ns(&dev->timer, next, READ_ONCE(dev->tick_slack_ns),
+                           HRTIMER_MODE_ABS_SOFT);
+}
+
+/* Queue the deferred char_count update on the configured backend. Caller holds dev->lock. */
+static void simplechar_bh_schedule(struct simplechar_dev *dev)
+{
+    struct kthread_worker *worker;
+    int cpu;
+
+    if (!dev->bh_queued_ns)
+        dev->bh_queued_ns = ktime_get_ns();
+
+    switch (simplechar_bh) {
+    case SIMPLECHAR_BH_TASKLET:
+        tasklet_schedule(&dev->tasklet);
+        break;
+    case SIMPLECHAR_BH_WQ:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+        queue_work(system_bh_wq, &dev->bh_work);
+#endif
+        break;
+    case SIMPLECHAR_BH_KTHREAD:
+        cpu = smp_processor_id();
+        worker = simplechar_kworkers[cpu] ?: simplechar_kworker_any;
+        kthread_queue_work(worker, &per_cpu_ptr(dev->kwork, cpu)->work);
+        break;
+    case SIMPLECHAR_BH_THREADED:
+        queue_work(simplechar_bh_wq, &dev->bh_work);
+        break;
+    }
+}
+
+/* Wait for any queued or running bottom half to finish. May sleep. */
+static void simplechar_bh_cancel(struct simplechar_dev *dev)
+{
+    int cpu;
+
+    switch (simplechar_bh) {
+    case SIMPLECHAR_BH_TASKLET:
+        tasklet_kill(&dev->tasklet);
+        break;
+    case SIMPLECHAR_BH_WQ:
+    case SIMPLECHAR_BH_THREADED:
+        cancel_work_sync(&dev->bh_work);
+        break;
+    case SIMPLECHAR_BH_KTHREAD:
+        for_each_possible_cpu(cpu)
+            kthread_cancel_work_sync(&per_cpu_ptr(dev->kwork, cpu)->work);
+        break;
+    }
+}
+
 static int simplechar_open(struct inode *inode, struct file *filp)
 {
-    filp->private_data = &simplechar_device;
-    printk(KERN_INFO "simplechar: Opened device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    struct simplechar_dev *dev = container_of(inode->i_cdev, struct simplechar_dev, cdev);
+    struct simplechar_file *f;
+
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f)
+        return -ENOMEM;
+    f->dev = dev;
+    filp->private_data = f;
+
+    spin_lock_bh(&dev->lock);
+    if (dev->users++ == 0) {
+        write_seqlock(&dev->stats_lock);
+        simplechar_tick_catchup(dev, ktime_get());
+        simplechar_stats_publish(dev);
+        write_sequnlock(&dev->stats_lock);
+        simplechar_timer_start(dev);
+    }
+    spin_unlock_bh(&dev->lock);
+
+    trace_simplechar_open(MINOR(inode->i_rdev));
+    simplechar_dbg("Opened device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
     return 0;
 }
 
 static int simplechar_release(struct inode *inode, struct file *filp)
 {
-    printk(KERN_INFO "simplechar: Released device, major=%d, minor=%d\n",
-           MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+
+    // No wakeups while idle; tick_count is caught up from tick_next later.
+    spin_lock_bh(&dev->lock);
+    if (--dev->users == 0)
+        hrtimer_cancel(&dev->timer);
+    spin_unlock_bh(&dev->lock);
+    simplechar_text_set(&f->text, NULL);
+    kfree(f);
+
+    trace_simplechar_release(MINOR(inode->i_rdev));
+    simplechar_dbg("Released device, major=%d, minor=%d\n",
+                   MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
     return 0;
 }
 
-static ssize_t simplechar_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* The tag of the read() text for the current state; *due is the tick count it shows. */
+static u64 simplechar_text_gen(struct simplechar_dev *dev, u64 *due)
 {
-    struct simplechar_dev *dev = filp->private_data;
-    char tmp_buf[BUFFER_SIZE];
-    unsigned long flags;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&dev->stats_lock);
+        *due = dev->tick_count + simplechar_ticks_due(dev->tick_next, dev->tick_period_ns,
+                                                      ktime_get());
+    } while (read_seqretry(&dev->stats_lock, seq));
+    // Both counts only grow, so the sum moves on with any write to either.
+    return (u64)seq + read_seqcount_begin(&dev->data_seq);
+}
+
+/*
+ * The read() text tagged (gen, due). It is formatted again only once the
+ * data or the counters have been written or another tick has fallen due,
+ * so repeated reads of an idle device are a copy.
+ */
+static struct simplechar_text *simplechar_text_snapshot(struct simplechar_dev *dev,
+                                                        u64 gen, u64 due)
+{
+    struct simplechar_text *t;
+    unsigned long tick_count, char_count;
+    u64 jitter_last, jitter_max, jitter_avg;
+    u64 tick_period, tick_slack;
+    ktime_t tick_next;
+    u64 bh_runs, bh_lat_max, bh_lat_avg;
+    u64 event_gen;
+    int log_done;
+    unsigned int seq;
+    size_t data_len;
     int len;
 
-    spin_lock_irqsave(&dev->lock, flags);
+    t = simplechar_text_lookup(&dev->text, gen, due);
+    if (t)
+        return t;
 
-    // Формування повного рядка
-    len = snprintf(tmp_buf, BUFFER_SIZE,
-                   "data: %s\n"
-                   "tick_count: %lu\n"
-                   "char_count: %lu\n"
-                   "log_done: %d\n",
-                   dev->data,
-                   dev->tick_count,
-                   dev->char_count,
-                   dev->log_done);
+    t = simplechar_text_alloc(TEXT_SIZE, gen, due);
+    if (!t)
+        return NULL;
 
-    spin_unlock_irqrestore(&dev->lock, flags);
+    /*
+     * Neither copy below takes a lock: writers only bump a sequence
+     * count, so readers never disable IRQs or hold up the timer and
+     * tasklet, and formatting happens on the private snapshot.
+     */
+    len = scnprintf(t->buf, TEXT_SIZE, "data: ");
+    do {
+        seq = read_seqcount_begin(&dev->data_seq);
+        data_len = min_t(size_t, strnlen(dev->data, BUFFER_SIZE),
+                         TEXT_SIZE - 1 - len);
+        memcpy(t->buf + len, dev->data, data_len);
+    } while (read_seqcount_retry(&dev->data_seq, seq));
+    len += data_len;
 
-    if (*f_pos >= len)
-        return 0;
+    do {
+        seq = read_seqbegin(&dev->stats_lock);
+        tick_count = dev->tick_count;
+        tick_period = dev->tick_period_ns;
+        tick_slack = dev->tick_slack_ns;
+        tick_next = dev->tick_next;
+        char_count = dev->char_count;
+        log_done = dev->log_done;
+        event_gen = dev->event_gen;
+        jitter_last = dev->jitter_last_ns;
+        jitter_max = dev->jitter_max_ns;
+        jitter_avg = dev->jitter_samples ?
+                     div64_u64(dev->jitter_sum_ns, dev->jitter_samples) : 0;
+        bh_runs = dev->bh_runs;
+        bh_lat_max = dev->bh_lat_max_ns;
+        bh_lat_avg = bh_runs ? div64_u64(dev->bh_lat_sum_ns, bh_runs) : 0;
+    } while (read_seqretry(&dev->stats_lock, seq));
+    tick_count += simplechar_ticks_due(tick_next, tick_period, ktime_get());
+
+    len += scnprintf(t->buf + len, TEXT_SIZE - len,
+                     "\n"
+                     "tick_count: %lu\n"
+                     "char_count: %lu\n"
+                     "log_done: %d\n"
+                     "event_gen: %llu\n"
+                     "tick_period_ns: %llu\n"
+                     "tick_slack_ns: %llu\n"
+                     "jitter_last_ns: %llu\n"
+                     "jitter_max_ns: %llu\n"
+                     "jitter_avg_ns: %llu\n"
+                     "bh_backend: %s\n"
+                     "bh_runs: %llu\n"
+                     "bh_lat_max_ns: %llu\n"
+                     "bh_lat_avg_ns: %llu\n",
+                     tick_count,
+                     char_count,
+                     log_done,
+                     event_gen,
+                     tick_period,
+                     tick_slack,
+                     jitter_last,
+                     jitter_max,
+                     jitter_avg,
+                     simplechar_bh_names[simplechar_bh],
+                     bh_runs,
+                     bh_lat_max,
+                     bh_lat_avg);
+    t->len = len;
+    simplechar_text_set(&dev->text, t);
+    return t;
+}
 
-    if (*f_pos + count > len)
-        count = len - *f_pos;
+static ssize_t simplechar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct simplechar_file *f = iocb->ki_filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos = *f_pos;
+    struct simplechar_text *text = NULL;
+    u64 event_gen, job_gen, gen, due;
+    unsigned int seq;
+    ssize_t retval;
 
-    if (copy_to_user(buf, tmp_buf + *f_pos, count)) {
-        printk(KERN_ERR "simplechar: Failed to copy data to user\n");
-        return -EFAULT;
+    if (ring_mode) {
+        retval = simplechar_ring_read(&dev->ring, to, count);
+        trace_simplechar_read(MINOR(dev->cdev.dev), pos, retval);
+        return retval;
     }
 
-    *f_pos += count;
-    return count;
+    /*
+     * Past the start, keep going through the snapshot this file began
+     * with. There is no llseek, so once it has been read to the end, or
+     * was read in one go and never kept, the file goes back to offset 0
+     * at EOF.
+     */
+    if (pos > 0) {
+        text = simplechar_text_get(&f->text);
+        if (!text || pos >= text->len) {
+            if (text) {
+                simplechar_text_put(text);
+                simplechar_text_set(&f->text, NULL);
+            }
+            *f_pos = 0;
+            trace_simplechar_read(MINOR(dev->cdev.dev), pos, 0);
+            return 0;
+        }
+    }
+
+    if (!text) {
+        // A read that starts a new snapshot consumes the pending poll events.
+        do {
+            seq = read_seqbegin(&dev->stats_lock);
+            event_gen = dev->event_gen;
+            job_gen = dev->job_gen;
+        } while (read_seqretry(&dev->stats_lock, seq));
+        WRITE_ONCE(f->seen_gen, event_gen);
+        WRITE_ONCE(f->seen_job_gen, job_gen);
+        gen = simplechar_text_gen(dev, &due);
+        retval = simplechar_text_read_cached(&dev->text, &f->text, gen, due, to, f_pos);
+        if (retval)
+            goto out;
+        text = simplechar_text_snapshot(dev, gen, due);
+        if (!text)
+            return -ENOMEM;
+    }
+
+    retval = simplechar_text_read_file(&f->text, text, to, f_pos);
+    simplechar_text_put(text);
+out:
+    if (retval == -EFAULT)
+        simplechar_dbg("Failed to copy data to user\n");
+    trace_simplechar_read(MINOR(dev->cdev.dev), pos, retval);
+    return retval;
 }
 
 
-static ssize_t simplechar_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* Clear the data and counters; the tick period and slack are kept. */
+static void simplechar_reset(struct simplechar_dev *dev)
 {
-    struct simplechar_dev *dev = filp->private_data;
+    // Stop the job and the bottom half first so nothing sleeps under the lock.
+    cancel_delayed_work_sync(&dev->work);
+    simplechar_bh_cancel(dev);
+    simplechar_ring_reset(&dev->ring);
+
+    spin_lock_bh(&dev->lock);
+    write_seqcount_begin(&dev->data_seq);
+    dev->size = 0;
+    memset(dev->data, 0, BUFFER_SIZE);
+    write_seqcount_end(&dev->data_seq);
+    dev->char_delta = 0;
+    dev->char_recount = true;
+    WRITE_ONCE(dev->work_delay, 0);
+    dev->job_running = false;
+    write_seqlock(&dev->stats_lock);
+    dev->tick_count = 0;
+    dev->tick_next = ktime_add_ns(ktime_get(), dev->tick_period_ns);
+    dev->char_count = 0;
+    dev->log_done = 0;
+    dev->jitter_last_ns = 0;
+    dev->jitter_max_ns = 0;
+    dev->jitter_sum_ns = 0;
+    dev->jitter_samples = 0;
+    dev->bh_runs = 0;
+    dev->bh_lat_last_ns = 0;
+    dev->bh_lat_max_ns = 0;
+    dev->bh_lat_sum_ns = 0;
+    simplechar_stats_publish(dev);
+    write_sequnlock(&dev->stats_lock);
+    simplechar_timer_start(dev);
+    spin_unlock_bh(&dev->lock);
+}
+
+static ssize_t simplechar_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct simplechar_file *f = iocb->ki_filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    size_t count = iov_iter_count(from);
+    loff_t *f_pos = &iocb->ki_pos;
     char tmp_buf[BUFFER_SIZE];
-    unsigned long new_work_delay;
-    unsigned long flags;
-
-    if (*f_pos + count > BUFFER_SIZE) {
-        count = BUFFER_SIZE - *f_pos;
-        if (count == 0) {
-            printk(KERN_ERR "simplechar: Buffer full\n");
-            return -ENOSPC;
+    ssize_t retval;
+
+    if (ring_mode) {
+        retval = simplechar_ring_write(&dev->ring, from, count);
+        if (retval > 0) {
+            queue_delayed_work(simplechar_wq, &dev->work,
+                               msecs_to_jiffies(READ_ONCE(dev->work_delay)));
+            wake_up_interruptible_poll(&dev->pollq, EPOLLIN | EPOLLRDNORM);
         }
+        trace_simplechar_write(MINOR(dev->cdev.dev), *f_pos, retval);
+        return retval;
     }
 
-    if (copy_from_user(tmp_buf, buf, count)) {
-        printk(KERN_ERR "simplechar: Failed to copy data from user\n");
-        return -EFAULT;
+    // Checked before the clamp: past the end, BUFFER_SIZE - *f_pos would wrap.
+    if (*f_pos >= BUFFER_SIZE) {
+        simplechar_dbg("Buffer full\n");
+        return -ENOSPC;
     }
+    count = min_t(size_t, count, BUFFER_SIZE - *f_pos);
 
-    tmp_buf[count] = '\0';
-
-    spin_lock_irqsave(&dev->lock, flags);
-
-    if (strncmp(tmp_buf, "reset", 5) == 0) {
-        dev->size = 0;
-        dev->tick_count = 0;
-        dev->char_count = 0;
-        dev->work_delay = 0;
-        dev->log_done = 0;
-        memset(dev->data, 0, BUFFER_SIZE);
-        mod_timer(&dev->timer, jiffies + msecs_to_jiffies(1000));
-        tasklet_kill(&dev->tasklet);
-        cancel_delayed_work(&dev->work);
-        flush_workqueue(dev->wq);
-        spin_unlock_irqrestore(&dev->lock, flags);
-        return count;
+    if (copy_from_iter(tmp_buf, count, from) != count) {
+        simplechar_dbg("Failed to copy data from user\n");
+        return -EFAULT;
     }
 
-    if (sscanf(tmp_buf, "work_delay=%lu", &new_work_delay) == 1) {
-        dev->work_delay = new_work_delay;
-        spin_unlock_irqrestore(&dev->lock, flags);
-        return count;
-    }
+    spin_lock_bh(&dev->lock);
 
+    // Only the overwritten range can change char_count.
+    dev->char_delta += (long)simplechar_count_nonzero(tmp_buf, count) -
+                       (long)simplechar_count_nonzero(dev->data + *f_pos, count);
+    write_seqcount_begin(&dev->data_seq);
     memcpy(dev->data + *f_pos, tmp_buf, count);
     *f_pos += count;
     if (dev->size < *f_pos)
         dev->size = *f_pos;
+    write_seqcount_end(&dev->data_seq);
 
-    tasklet_schedule(&dev->tasklet);
-    queue_delayed_work(dev->wq, &dev->work, msecs_to_jiffies(dev->work_delay));
+    simplechar_bh_schedule(dev);
+    queue_delayed_work(simplechar_wq, &dev->work, msecs_to_jiffies(READ_ONCE(dev->work_delay)));
 
-    spin_unlock_irqrestore(&dev->lock, flags);
+    spin_unlock_bh(&dev->lock);
 
-    printk(KERN_INFO "simplechar: Wrote %zd bytes to pos %lld\n", count, *f_pos);
+    trace_simplechar_write(MINOR(dev->cdev.dev), *f_pos - count, count);
+    simplechar_dbg("Wrote %zd bytes to pos %lld\n", count, *f_pos);
     return count;
 }
 
-static void simplechar_timer_fn(struct timer_list *t)
+static long simplechar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct simplechar_dev *dev = from_timer(dev, t, timer);
-    unsigned long flags;
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    void __user *argp = (void __user *)arg;
+    struct simplechar_time_stats st;
+    unsigned int seq;
+    ktime_t now;
+    u64 val;
+
+    switch (cmd) {
+    case SIMPLECHAR_IOC_RESET:
+        simplechar_reset(dev);
+        return 0;
+
+    case SIMPLECHAR_TIME_GET_STATS:
+        do {
+            seq = read_seqbegin(&dev->stats_lock);
+            st = *dev->stats;
+        } while (read_seqretry(&dev->stats_lock, seq));
+        return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
 
-    spin_lock_irqsave(&dev->lock, flags);
-    dev->tick_count++;
-    spin_unlock_irqrestore(&dev->lock, flags);
+    case SIMPLECHAR_TIME_SET_WORK_DELAY:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > UINT_MAX)
+            return -EINVAL;
+        WRITE_ONCE(dev->work_delay, val);
+        return 0;
+
+    case SIMPLECHAR_TIME_SET_TICK:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val < TICK_MIN_US || val > TICK_MAX_US)
+            return -EINVAL;
+        spin_lock_bh(&dev->lock);
+        write_seqlock(&dev->stats_lock);
+        now = ktime_get();
+        simplechar_tick_catchup(dev, now);
+        dev->tick_period_ns = val * NSEC_PER_USEC;
+        dev->tick_next = ktime_add_ns(now, dev->tick_period_ns);
+        simplechar_stats_publish(dev);
+        write_sequnlock(&dev->stats_lock);
+        simplechar_timer_start(dev);
+        spin_unlock_bh(&dev->lock);
+        return 0;
 
-    mod_timer(&dev->timer, jiffies + msecs_to_jiffies(1000));
+    case SIMPLECHAR_TIME_SET_TICK_SLACK:
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        if (val > TICK_MAX_US)
+            return -EINVAL;
+        spin_lock_bh(&dev->lock);
+        write_seqlock(&dev->stats_lock);
+        WRITE_ONCE(dev->tick_slack_ns, val * NSEC_PER_USEC);
+        write_sequnlock(&dev->stats_lock);
+        simplechar_timer_start(dev);
+        spin_unlock_bh(&dev->lock);
+        return 0;
+
+    case SIMPLECHAR_TIME_SET_GEN:
+        // Make poll wait for the first event after generation N.
+        if (get_user(val, (u64 __user *)argp))
+            return -EFAULT;
+        WRITE_ONCE(f->seen_gen, val);
+        return 0;
+    }
+
+    return -ENOTTY;
 }
 
-static void simplechar_tasklet_fn(unsigned long arg)
+static enum hrtimer_restart simplechar_timer_fn(struct hrtimer *t)
 {
-    struct simplechar_dev *dev = (struct simplechar_dev *)arg;
-    unsigned long flags;
+    struct simplechar_dev *dev = container_of(t, struct simplechar_dev, timer);
+    ktime_t now = hrtimer_cb_get_time(t);
+    u64 jitter = ktime_to_ns(ktime_sub(now, hrtimer_get_softexpires(t)));
 
-    spin_lock_irqsave(&dev->lock, flags);
-    dev->char_count = 0;
-    for (size_t i = 0; i < dev->size; i++) {
-        if (dev->data[i] != '\0')
-            dev->char_count++;
+    write_seqlock(&dev->stats_lock);
+    // Ticks missed while the timer was late are counted, not dropped.
+    simplechar_tick_catchup(dev, now);
+    hrtimer_set_expires_range_ns(t, dev->tick_next, READ_ONCE(dev->tick_slack_ns));
+    dev->jitter_last_ns = jitter;
+    if (jitter > dev->jitter_max_ns)
+        dev->jitter_max_ns = jitter;
+    dev->jitter_sum_ns += jitter;
+    dev->jitter_samples++;
+    dev->event_gen++;
+    simplechar_stats_publish(dev);
+    write_sequnlock(&dev->stats_lock);
+
+    if (wq_has_sleeper(&dev->pollq))
+        wake_up_interruptible_poll(&dev->pollq, EPOLLIN | EPOLLRDNORM);
+
+    return HRTIMER_RESTART;
+}
+
+/* Apply the pending char_count change; shared by all bottom-half backends. */
+static void simplechar_count_fn(struct simplechar_dev *dev)
+{
+    u64 now = ktime_get_ns();
+    u64 queued;
+
+    spin_lock_bh(&dev->lock);
+    queued = dev->bh_queued_ns;
+    dev->bh_queued_ns = 0;
+    write_seqlock(&dev->stats_lock);
+    if (dev->char_recount) {
+        dev->char_count = simplechar_count_nonzero(dev->data, dev->size);
+        dev->char_recount = false;
+    } else {
+        dev->char_count += dev->char_delta;
     }
-    spin_unlock_irqrestore(&dev->lock, flags);
+    dev->char_delta = 0;
+    if (queued) {
+        dev->bh_lat_last_ns = now - queued;
+        if (dev->bh_lat_last_ns > dev->bh_lat_max_ns)
+            dev->bh_lat_max_ns = dev->bh_lat_last_ns;
+        dev->bh_lat_sum_ns += dev->bh_lat_last_ns;
+        dev->bh_runs++;
+    }
+    simplechar_stats_publish(dev);
+    write_sequnlock(&dev->stats_lock);
+    spin_unlock_bh(&dev->lock);
 }
 
+static void simplechar_tasklet_fn(unsigned long arg)
+{
+    simplechar_count_fn((struct simplechar_dev *)arg);
+}
+
+static void simplechar_bh_work_fn(struct work_struct *work)
+{
+    simplechar_count_fn(container_of(work, struct simplechar_dev, bh_work));
+}
+
+static void simplechar_kwork_fn(struct kthread_work *work)
+{
+    simplechar_count_fn(container_of(work, struct simplechar_kwork, work)->dev);
+}
+
+/*
+ * The deferred job runs as a chain of short delayed-work steps instead
+ * of one long sleep, so it never pins a worker and cancel_delayed_work_sync()
+ * stops it within one step.
+ */
 static void simplechar_work_fn(struct work_struct *work)
 {
     struct simplechar_dev *dev = container_of(work, struct simplechar_dev, work.work);
-    unsigned long flags;
+    unsigned long now = jiffies;
 
-    msleep(10000);
+    spin_lock_bh(&dev->lock);
+    if (!dev->job_running) {
+        dev->job_running = true;
+        dev->job_end = now + msecs_to_jiffies(JOB_DURATION_MS);
+    }
+    if (time_before(now, dev->job_end)) {
+        queue_delayed_work(simplechar_wq, &dev->work,
+                           min(dev->job_end - now, msecs_to_jiffies(JOB_STEP_MS)));
+        spin_unlock_bh(&dev->lock);
+        return;
+    }
+    dev->job_running = false;
+    spin_unlock_bh(&dev->lock);
 
-    spin_lock_irqsave(&dev->lock, flags);
+    write_seqlock_bh(&dev->stats_lock);
     dev->log_done = 1;
-    spin_unlock_irqrestore(&dev->lock, flags);
+    dev->event_gen++;
+    dev->job_gen++;
+    simplechar_stats_publish(dev);
+    write_sequnlock_bh(&dev->stats_lock);
+
+    wake_up_interruptible_poll(&dev->pollq, EPOLLIN | EPOLLRDNORM | EPOLLPRI);
+}
+
+/*
+ * EPOLLIN: a tick or job completed since this file's last snapshot, or ring
+ * data is queued. EPOLLPRI: a job completed. A read() that starts a new
+ * snapshot clears both: the first read after open, and the read after one
+ * that hit the end of the previous snapshot, at any offset.
+ */
+static __poll_t simplechar_poll(struct file *filp, poll_table *wait)
+{
+    struct simplechar_file *f = filp->private_data;
+    struct simplechar_dev *dev = f->dev;
+    u64 event_gen, job_gen;
+    unsigned int seq;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->pollq, wait);
+
+    do {
+        seq = read_seqbegin(&dev->stats_lock);
+        event_gen = dev->event_gen;
+        job_gen = dev->job_gen;
+    } while (read_seqretry(&dev->stats_lock, seq));
+
+    if (event_gen > READ_ONCE(f->seen_gen))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ring_mode && simplechar_ring_used(&dev->ring))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (job_gen > READ_ONCE(f->seen_job_gen))
+        mask |= EPOLLPRI;
+
+    return mask;
+}
+
+/*
+ * Map the data page and/or the stats page read-only, see simplechar.h.
+ * Writes have to go through write() so char_count stays correct.
+ */
+static int simplechar_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct simplechar_file *f = filp->private_data;
+
+    return simplechar_mmap_pages(vma, f->dev->data, f->dev->stats);
 }
 
 static struct file_operations simplechar_fops = {
     .owner = THIS_MODULE,
     .open = simplechar_open,
     .release = simplechar_release,
-    .read = simplechar_read,
-    .write = simplechar_write,
+    .read_iter = simplechar_read_iter,
+    .write_iter = simplechar_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = simplechar_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = simplechar_poll,
+    .mmap = simplechar_mmap,
 };
 
-static int __init simplechar_init(void)
+static void simplechar_bh_teardown(void)
 {
-    int err;
+    int cpu;
 
-    printk(KERN_INFO "simplechar: Initializing module\n");
+    if (simplechar_kworkers) {
+        for_each_possible_cpu(cpu) {
+            if (simplechar_kworkers[cpu])
+                kthread_destroy_worker(simplechar_kworkers[cpu]);
+        }
+        kfree(simplechar_kworkers);
+        simplechar_kworkers = NULL;
+    }
+    if (simplechar_bh_wq) {
+        destroy_workqueue(simplechar_bh_wq);
+        simplechar_bh_wq = NULL;
+    }
+}
 
-    err = alloc_chrdev_region(&simplechar_devno, 0, 1, "simplechartime");
-    if (err < 0) {
-        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
-        return err;
+static int simplechar_bh_setup(void)
+{
+    struct kthread_worker *worker;
+    int cpu;
+    int ret;
+
+    ret = sysfs_match_string(simplechar_bh_names, bh_backend);
+    if (ret < 0) {
+        printk(KERN_ERR "simplechar: Unknown bh_backend %s\n", bh_backend);
+        return -EINVAL;
+    }
+    simplechar_bh = ret;
+
+    switch (simplechar_bh) {
+    case SIMPLECHAR_BH_TASKLET:
+        break;
+    case SIMPLECHAR_BH_WQ:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+        printk(KERN_ERR "simplechar: bh_wq needs a 6.9+ kernel\n");
+        return -EINVAL;
+#endif
+        break;
+    case SIMPLECHAR_BH_KTHREAD:
+        simplechar_kworkers = kcalloc(nr_cpu_ids, sizeof(*simplechar_kworkers), GFP_KERNEL);
+        if (!simplechar_kworkers)
+            return -ENOMEM;
+        for_each_online_cpu(cpu) {
+            worker = kthread_create_worker_on_cpu(cpu, 0, "simplechar_bh/%d", cpu);
+            if (IS_ERR(worker)) {
+                simplechar_bh_teardown();
+                return PTR_ERR(worker);
+            }
+            sched_set_fifo_low(worker->task);
+            simplechar_kworkers[cpu] = worker;
+            simplechar_kworker_any = worker;
+        }
+        break;
+    case SIMPLECHAR_BH_THREADED:
+        simplechar_bh_wq = alloc_workqueue("simplechar_bh", WQ_UNBOUND | WQ_HIGHPRI, 0);
+        if (!simplechar_bh_wq)
+            return -ENOMEM;
+        break;
     }
 
-    simplechar_device.data = kzalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!simplechar_device.data) {
+    return 0;
+}
+
+static struct simplechar_dev *simplechar_create_dev(int index)
+{
+    int node = simplechar_dev_node(index);
+    dev_t devno = MKDEV(MAJOR(simplechar_devno), index);
+    struct simplechar_dev *dev;
+    int err;
+    int cpu;
+
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    BUILD_BUG_ON(BUFFER_SIZE > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct simplechar_time_stats) > PAGE_SIZE);
+    dev->data = simplechar_alloc_page(node);
+    dev->stats = simplechar_alloc_page(node);
+    if (!dev->data || !dev->stats) {
         err = -ENOMEM;
         goto fail_alloc;
     }
 
-    simplechar_device.size = 0;
-    simplechar_device.tick_count = 0;
-    simplechar_device.char_count = 0;
-    simplechar_device.work_delay = 0;
-    simplechar_device.log_done = 0;
-    spin_lock_init(&simplechar_device.lock);
+    init_waitqueue_head(&dev->pollq);
+    spin_lock_init(&dev->lock);
+    seqcount_spinlock_init(&dev->data_seq, &dev->lock);
+    seqlock_init(&dev->stats_lock);
 
-    timer_setup(&simplechar_device.timer, simplechar_timer_fn, 0);
-    mod_timer(&simplechar_device.timer, jiffies + msecs_to_jiffies(1000));
+    dev->tick_period_ns = NSEC_PER_SEC;
+    dev->tick_next = ktime_add_ns(ktime_get(), NSEC_PER_SEC);
+    hrtimer_init(&dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    dev->timer.function = simplechar_timer_fn;
+    simplechar_stats_publish(dev);
+    simplechar_ring_init(&dev->ring, simplechar_ring_cache, (size_t)ring_cap_kb * 1024);
 
-    tasklet_init(&simplechar_device.tasklet, simplechar_tasklet_fn, (unsigned long)&simplechar_device);
+    tasklet_init(&dev->tasklet, simplechar_tasklet_fn, (unsigned long)dev);
+    INIT_WORK(&dev->bh_work, simplechar_bh_work_fn);
+    if (simplechar_bh == SIMPLECHAR_BH_KTHREAD) {
+        dev->kwork = alloc_percpu(struct simplechar_kwork);
+        if (!dev->kwork) {
+            err = -ENOMEM;
+            goto fail_alloc;
+        }
+        for_each_possible_cpu(cpu) {
+            struct simplechar_kwork *kw = per_cpu_ptr(dev->kwork, cpu);
 
-    simplechar_device.wq = create_singlethread_workqueue("simplechar_wq");
-    if (!simplechar_device.wq) {
-        err = -ENOMEM;
-        goto fail_wq;
+            kthread_init_work(&kw->work, simplechar_kwork_fn);
+            kw->dev = dev;
+        }
     }
 
-    INIT_DELAYED_WORK(&simplechar_device.work, simplechar_work_fn);
+    INIT_DELAYED_WORK(&dev->work, simplechar_work_fn);
 
-    cdev_init(&simplechar_device.cdev, &simplechar_fops);
-    simplechar_device.cdev.owner = THIS_MODULE;
-    err = cdev_add(&simplechar_device.cdev, simplechar_devno, 1);
+    cdev_init(&dev->cdev, &simplechar_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
     if (err) {
         printk(KERN_ERR "simplechar: Failed to add cdev\n");
         goto fail_cdev;
     }
 
+    if (num_devices == 1)
+        device_create(simplechar_class, NULL, devno, NULL, "simplechartime");
+    else
+        device_create(simplechar_class, NULL, devno, NULL, "simplechartime%d", index);
+
+    return dev;
+
+fail_cdev:
+    free_percpu(dev->kwork);
+fail_alloc:
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+    return ERR_PTR(err);
+}
+
+static void simplechar_destroy_dev(struct simplechar_dev *dev)
+{
+    device_destroy(simplechar_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+    cancel_delayed_work_sync(&dev->work);
+    hrtimer_cancel(&dev->timer);
+    simplechar_bh_cancel(dev);
+    free_percpu(dev->kwork);
+    simplechar_ring_destroy(&dev->ring);
+    simplechar_text_set(&dev->text, NULL);
+    free_page((unsigned long)dev->stats);
+    free_page((unsigned long)dev->data);
+    kfree(dev);
+}
+
+static int __init simplechar_init(void)
+{
+    struct simplechar_dev *dev;
+    int err;
+    int i;
+
+    printk(KERN_INFO "simplechar: Initializing module\n");
+
+    if (num_devices < 1 || num_devices > MAX_DEVICES) {
+        printk(KERN_ERR "simplechar: num_devices must be 1..%d\n", MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    err = simplechar_bh_setup();
+    if (err)
+        return err;
+
+    simplechar_ring_cache = simplechar_ring_cache_create("simplechartime_ring");
+    if (!simplechar_ring_cache) {
+        err = -ENOMEM;
+        goto fail_cache;
+    }
+
+    simplechar_wq = alloc_workqueue("simplechar_wq",
+                                   WQ_UNBOUND | (wq_highpri ? WQ_HIGHPRI : 0),
+                                   wq_max_active);
+    if (!simplechar_wq) {
+        err = -ENOMEM;
+        goto fail_wq;
+    }
+
+    simplechar_devices = kcalloc(num_devices, sizeof(*simplechar_devices), GFP_KERNEL);
+    if (!simplechar_devices) {
+        err = -ENOMEM;
+        goto fail_devices;
+    }
+
+    err = alloc_chrdev_region(&simplechar_devno, 0, num_devices, "simplechartime");
+    if (err < 0) {
+        printk(KERN_ERR "simplechar: Failed to allocate device number\n");
+        goto fail_region;
+    }
+
     simplechar_class = class_create("simplechartime");
     if (IS_ERR(simplechar_class)) {
         err = PTR_ERR(simplechar_class);
@@ -252,32 +1039,46 @@ static int __init simplechar_init(void)
         goto fail_class;
     }
 
-    device_create(simplechar_class, NULL, simplechar_devno, NULL, "simplechartime");
+    for (i = 0; i < num_devices; i++) {
+        dev = simplechar_create_dev(i);
+        if (IS_ERR(dev)) {
+            err = PTR_ERR(dev);
+            goto fail_dev;
+        }
+        simplechar_devices[i] = dev;
+    }
 
     return 0;
 
+fail_dev:
+    while (i--)
+        simplechar_destroy_dev(simplechar_devices[i]);
+    class_destroy(simplechar_class);
 fail_class:
-    cdev_del(&simplechar_device.cdev);
-fail_cdev:
-    destroy_workqueue(simplechar_device.wq);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+fail_region:
+    kfree(simplechar_devices);
+fail_devices:
+    destroy_workqueue(simplechar_wq);
 fail_wq:
-    kfree(simplechar_device.data);
-fail_alloc:
-    unregister_chrdev_region(simplechar_devno, 1);
+    kmem_cache_destroy(simplechar_ring_cache);
+fail_cache:
+    simplechar_bh_teardown();
     return err;
 }
 
 static void __exit simplechar_exit(void)
 {
-    device_destroy(simplechar_class, simplechar_devno);
+    int i;
+
+    for (i = 0; i < num_devices; i++)
+        simplechar_destroy_dev(simplechar_devices[i]);
     class_destroy(simplechar_class);
-    cdev_del(&simplechar_device.cdev);
-    flush_workqueue(simplechar_device.wq);
-    destroy_workqueue(simplechar_device.wq);
-    del_timer_sync(&simplechar_device.timer);
-    tasklet_kill(&simplechar_device.tasklet);
-    kfree(simplechar_device.data);
-    unregister_chrdev_region(simplechar_devno, 1);
+    unregister_chrdev_region(simplechar_devno, num_devices);
+    kfree(simplechar_devices);
+    destroy_workqueue(simplechar_wq);
+    kmem_cache_destroy(simplechar_ring_cache);
+    simplechar_bh_teardown();
     printk(KERN_INFO "simplechar: Module unloaded\n");
 }
 
@@ -0,0 +1,18 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplechar_times
+
+#if !defined(_TIMERTEST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TIMERTEST_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include <simplechar_trace.h>
+
+#endif /* _TIMERTEST_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE timertest_trace
+#include <trace/define_trace.h>